@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,7 +12,18 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
-
+// * bawrite starts a write without waiting for it, so that
+//     several can be in flight; call biowait before brelse.
+// * breada starts reading a block that will be needed soon,
+//     and returns without a buffer.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets, each
+// with its own lock, so lookups of different blocks rarely contend.
+// A buffer's refcnt is protected by the lock of its bucket.
+// Recycling an unused buffer for a new block is serialized by
+// bcache.lock and picks a victim with the CLOCK algorithm: a hand
+// sweeps bcache.buf[], skipping buffers in use and giving recently
+// released ones (b->used set) a second chance.
 
 #include "types.h"
 #include "param.h"
@@ -23,14 +34,24 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET ((NBUF/2) | 1)
+#define HASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+// most breada() reads in flight at once, so that read-ahead
+// leaves buffers for everything else.
+#define NREADAHEAD (NBUF/4)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;   // hash chain, through b->next.
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes recycling; protects hand.
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+  int hand;              // CLOCK hand, index into buf[].
+  int nreadahead;        // breada() reads in flight.
 } bcache;
 
 void
@@ -39,19 +60,77 @@ binit(void)
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head = 0;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Put all buffers in the bucket for block 0 of device 0,
+  // which is never used, until they are recycled.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->next = bcache.bucket[HASH(0, 0)].head;
+    bcache.bucket[HASH(0, 0)].head = b;
   }
 }
 
+// Look for block blockno on device dev in its hash bucket.
+// Caller must hold the bucket's lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b != 0; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Remove b from its hash bucket. Caller must hold the bucket's lock.
+static void
+bunlink(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != 0; pp = &(*pp)->next){
+    if(*pp == b){
+      *pp = b->next;
+      b->next = 0;
+      return;
+    }
+  }
+  panic("bunlink");
+}
+
+// Pick an unused buffer with the CLOCK algorithm and take it
+// out of its bucket. Returns 0 if all are in use.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  for(int n = 0; n < 2*NBUF; n++){
+    b = &bcache.buf[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % NBUF;
+    bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+    acquire(&bk->lock);
+    if(b->refcnt == 0){
+      if(b->used){
+        b->used = 0;
+      } else {
+        bunlink(bk, b);
+        release(&bk->lock);
+        return b;
+      }
+    }
+    release(&bk->lock);
+  }
+  return 0;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
@@ -59,33 +138,49 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk = &bcache.bucket[HASH(dev, blockno)];
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Only processes holding bcache.lock insert into buckets,
+  // so check again in case another one cached the block
+  // while we waited for the lock.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  panic("bget: no buffers");
+  release(&bk->lock);
+
+  // Recycle an unused buffer.
+  if((b = bvictim()) == 0)
+    panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +197,71 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading a block into the cache, unless it is cached
+// already, and return without waiting. The buffer stays locked
+// until the read finishes; then biodone() releases it. Read-ahead
+// is only a hint, so give up if no buffer is free or too many
+// read-aheads are in flight.
+void
+breada(uint dev, uint blockno)
+{
+  struct buf *b;
+  struct bucket *bk = &bcache.bucket[HASH(dev, blockno)];
+
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return;
+
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b || bcache.nreadahead >= NREADAHEAD || (b = bvictim()) == 0){
+    release(&bcache.lock);
+    return;
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  __sync_fetch_and_add(&bcache.nreadahead, 1);
+  release(&bcache.lock);
+
+  acquiresleep(&b->lock);
+  if(b->valid){
+    // another process read it while we waited for the lock.
+    __sync_fetch_and_sub(&bcache.nreadahead, 1);
+    brelse(b);
+    return;
+  }
+  b->async = 1;
+  virtio_disk_submit(b, 0);
+}
+
+// Called by the disk interrupt handler when the read that
+// breada() started on b has finished. Releases b for the
+// process that called breada(), which has moved on.
+void
+biodone(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+
+  b->valid = 1;
+  releasesleep(&b->lock);
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->used = 1;
+  release(&bk->lock);
+  __sync_fetch_and_sub(&bcache.nreadahead, 1);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +271,76 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, but don't wait.
+// b must stay locked until biowait(b) returns, so that
+// several writes can be in the disk queue at once.
+void
+bawrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  virtio_disk_submit(b, 1);
+}
+
+// Start writing n locked buffers for consecutive blocks,
+// bs[0] first, as a single disk request. Wait for each
+// with biowait().
+void
+bawritev(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bawritev");
+  virtio_disk_submitv(bs, n, 1);
+}
+
+// Wait for the I/O started on locked buffer b to finish.
+void
+biowait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("biowait");
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Mark it recently used so that CLOCK passes it over once.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->used = 1;
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 
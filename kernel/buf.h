@@ -1,12 +1,13 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // breada(): release when the read finishes
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  int used;    // released since the CLOCK hand last passed?
+  struct buf *next; // hash chain
   uchar data[BSIZE];
 };
 
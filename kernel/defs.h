@@ -2,18 +2,25 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kcache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bawrite(struct buf*);
+void            bawritev(struct buf**, int);
+void            breada(uint, uint);
+void            biodone(struct buf*);
+void            biowait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -33,6 +40,8 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int);
+int             filetee(struct file*, struct file*, int);
 
 // fs.c
 void            fsinit(int);
@@ -43,6 +52,7 @@ struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
+void            iexec(struct inode*, int);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
@@ -50,6 +60,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -59,6 +70,15 @@ void            ireclaim(int);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            krefinc(void *);
+int             krefcnt(void *);
+void*           kzalloc(void);
+int             kzerofill(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+int             kfreeblocks(int);
+void            supersplit(void *);
+void            kmemdump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -66,11 +86,28 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// pcache.c
+void            pcacheinit(void);
+char*           pcacheget(struct inode*, uint);
+void            pcacheinval(struct inode*, uint, uint);
+int             pcachereclaim(void);
+char*           pcachefind(struct inode*, uint);
+char*           pcacheshare(struct inode*, uint);
+void            pcacheunshare(struct inode*, uint, char*);
+void            pcachetrunc(struct inode*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
+int             pipewbegin(struct pipe*, int, char**);
+void            pipewend(struct pipe*, int);
+int             piperbegin(struct pipe*, int, char**);
+void            piperend(struct pipe*, int);
+int             pipegetsize(struct pipe*);
+int             pipesize(struct pipe*, int);
 
 // printf.c
 int             printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
@@ -82,7 +119,6 @@ int             cpuid(void);
 void            kexit(int);
 int             kfork(void);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kkill(int);
@@ -97,7 +133,9 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             kwait(uint64);
 void            wakeup(void*);
+void            wakeupone(void*);
 void            yield(void);
+void            setrun(struct proc*);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -113,6 +151,12 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+struct kcache*  kcachecreate(char*, uint, void (*)(void*));
+void*           kcachealloc(struct kcache*);
+void            kcachefree(struct kcache*, void*);
+int             kcachereclaim(void);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -169,6 +213,16 @@ int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 int             ismapped(pagetable_t, uint64);
 uint64          vmfault(pagetable_t, uint64, int);
+uint64          cowfault(pagetable_t, uint64);
+uint64          uvmlend(pagetable_t, uint64);
+int             uvmprefault(uint64, uint64);
+void            vmadup(struct vma*, struct vma*);
+void            vmafree(struct vma*);
+int             vmaoverlap(struct vma*, uint64, uint64);
+uint64          vmaplace(struct proc*, uint64);
+int             vmaunmap(pagetable_t, struct vma*, uint64, uint64);
+void            vmaclose(pagetable_t, struct vma*);
+int             vmacopy(pagetable_t, pagetable_t, struct vma*);
 
 // plic.c
 void            plicinit(void);
@@ -179,7 +233,17 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
+// fill memory with junk, except in kernels built with NOJUNK.
+#ifdef NOJUNK
+#define junk(dst, c, n)
+#else
+#define junk(dst, c, n) memset((dst), (c), (n))
+#endif
+
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -6,8 +6,9 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 // map ELF permissions to PTE permission bits.
 int flags2perm(int flags)
@@ -23,18 +24,27 @@ int flags2perm(int flags)
 //
 // the implementation of the exec() system call
 //
+// Program segments are not read in here. Each becomes a region
+// of the new image (see struct vma) whose pages vmfault()
+// reads from the executable when the program first touches
+// them, so exec costs only what the program uses. The file
+// can't be written while they do (see iexec()).
+//
 int
 kexec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
+
   begin_op();
 
   // Open the executable file.
@@ -55,7 +65,7 @@ kexec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -67,12 +77,23 @@ kexec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr + ph.memsz > TRAPFRAME - (USERSTACK+1)*PGSIZE)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz || nvma >= NVMA)
       goto bad;
+    if(ph.memsz == 0)
+      continue;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = ph.vaddr + ph.memsz;
+    vma[nvma].perm = flags2perm(ph.flags);
+    vma[nvma].ip = idup(ip);
+    iexec(ip, 1);
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    nvma++;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -133,7 +154,12 @@ kexec(char *path, char **argv)
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  vmaclose(oldpagetable, p->vma);
   proc_freepagetable(oldpagetable, oldsz);
+  begin_op();
+  vmafree(p->vma);
+  end_op();
+  memmove(p->vma, vma, sizeof(vma));
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -144,30 +170,8 @@ kexec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  begin_op();
+  vmafree(vma);
+  end_op();
   return -1;
 }
-
-// Load an ELF program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
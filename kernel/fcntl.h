@@ -3,3 +3,16 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+// fcntl() commands.
+#define F_SETPIPE_SZ 1031  // resize a pipe's buffer
+#define F_GETPIPE_SZ 1032
+
+// mmap() protection and flags.
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define PROT_EXEC   0x4
+
+#define MAP_SHARED  0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FAILED  ((void *)-1)
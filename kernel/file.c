@@ -13,16 +13,27 @@
 #include "stat.h"
 #include "proc.h"
 
+// read-ahead window, in blocks, after the first
+// sequential read, and at most.
+#define RAMIN 4
+#define RAMAX 32
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
 struct devsw devsw[NDEV];
+
+// Open files come from a slab cache, as many as memory allows.
+// ftable.lock protects their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kcache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kcachecreate("file", sizeof(struct file), 0);
 }
 
 // Allocate a file structure.
@@ -31,16 +42,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kcachealloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +75,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kcachefree(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,6 +106,34 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Sequential read-ahead for an n-byte read of f at f->off.
+// A read that starts where the last one ended doubles the
+// window, and starts reading this read's blocks and a window's
+// worth after them, less those already started; any other
+// read shuts the window.
+// Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, int n)
+{
+  uint bn, end;
+
+  if(f->off != f->raoff){
+    f->rawin = 0;
+    f->ranext = 0;
+    return;
+  }
+  if(f->rawin == 0)
+    f->rawin = RAMIN;
+  else if(f->rawin < RAMAX)
+    f->rawin *= 2;
+  bn = f->off / BSIZE;
+  end = (f->off + n + BSIZE - 1) / BSIZE + f->rawin;
+  if(bn < f->ranext)
+    bn = f->ranext;
+  ireadahead(f->ip, bn, end);
+  f->ranext = end;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -111,16 +144,22 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // the copy to addr happens with a lock held.
+  if(uvmprefault(addr, n) < 0)
+    return -1;
+
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, 1, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    readahead(f, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    f->raoff = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -139,8 +178,12 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  // the copy from addr happens with a lock held.
+  if(uvmprefault(addr, n) < 0)
+    return -1;
+
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, 1, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
@@ -178,3 +221,133 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+
+// Read up to n bytes from inode file f to kernel address dst.
+static int
+splicein(struct file *f, char *dst, int n)
+{
+  int r;
+
+  ilock(f->ip);
+  readahead(f, n);
+  if((r = readi(f->ip, 0, (uint64)dst, f->off, n)) > 0)
+    f->off += r;
+  f->raoff = f->off;
+  iunlock(f->ip);
+  return r;
+}
+
+// Write n bytes from kernel address src to inode file f,
+// in one transaction.
+static int
+spliceout(struct file *f, char *src, int n)
+{
+  int r;
+
+  begin_op();
+  ilock(f->ip);
+  if((r = writei(f->ip, 0, (uint64)src, f->off, n)) > 0)
+    f->off += r;
+  iunlock(f->ip);
+  end_op();
+  return r;
+}
+
+// Move up to n bytes from file in to file out without copying
+// through user memory. From a file to a pipe, readi() fills
+// the pipe's ring straight from the buffer cache; from a pipe
+// to a file, writei() copies straight from the ring into the
+// file's blocks. Between files, and between pipes, the bytes go
+// through a page of kernel memory; a splice between pipes takes
+// them out of in before it writes them to out, since it must
+// not keep in's readers waiting while it waits for room in out.
+// Returns the number of bytes moved, 0 at end of file, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  // as in filewrite(), to fit a transaction.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  int tot = 0, m, r = 0;
+  char *p, *page = 0;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if((in->type != FD_PIPE && in->type != FD_INODE) ||
+     (out->type != FD_PIPE && out->type != FD_INODE))
+    return -1;
+  if(in->type == FD_PIPE && out->type == FD_PIPE && in->pipe == out->pipe)
+    return -1;
+  if(in->type == out->type && (page = kalloc()) == 0)
+    return -1;
+
+  while(tot < n){
+    if(in->type == FD_PIPE && out->type == FD_PIPE){
+      if((m = piperbegin(in->pipe, min(n - tot, PGSIZE), &p)) <= 0){
+        r = m;
+        break;
+      }
+      memmove(page, p, m);
+      piperend(in->pipe, m);
+      r = pipewrite(out->pipe, 0, (uint64)page, m);
+    } else if(in->type == FD_PIPE){
+      if((m = piperbegin(in->pipe, min(n - tot, max), &p)) <= 0){
+        r = m;
+        break;
+      }
+      r = spliceout(out, p, m);
+      piperend(in->pipe, r > 0 ? r : 0);
+    } else if(out->type == FD_PIPE){
+      if((m = pipewbegin(out->pipe, n - tot, &p)) < 0){
+        r = m;
+        break;
+      }
+      r = splicein(in, p, m);
+      pipewend(out->pipe, r > 0 ? r : 0);
+    } else {
+      if((m = splicein(in, page, min(n - tot, max))) <= 0){
+        r = m;
+        break;
+      }
+      r = spliceout(out, page, m);
+    }
+    if(r > 0)
+      tot += r;
+    if(r != m)
+      break;
+  }
+
+  if(page)
+    kfree(page);
+  return tot > 0 ? tot : r;
+}
+
+// Copy up to n bytes from the head of pipe in to pipe out,
+// leaving them in in. As in filesplice(), they go through a
+// page of kernel memory, so that in is free again before
+// pipewrite() waits for room in out.
+// Returns the number of bytes copied, 0 if in is empty and
+// has no writer, or -1.
+int
+filetee(struct file *in, struct file *out, int n)
+{
+  char *p, *page;
+  int m, r;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type != FD_PIPE || out->type != FD_PIPE || in->pipe == out->pipe)
+    return -1;
+  if(n == 0)
+    return 0;
+  if((page = kalloc()) == 0)
+    return -1;
+  if((m = piperbegin(in->pipe, min(n, PGSIZE), &p)) <= 0){
+    kfree(page);
+    return m;
+  }
+  memmove(page, p, m);
+  piperend(in->pipe, 0);
+  r = pipewrite(out->pipe, 0, (uint64)page, m);
+  kfree(page);
+  return r;
+}
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint raoff;        // FD_INODE: where a sequential read would start
+  uint ranext;       // FD_INODE: first block not yet read ahead
+  int rawin;         // FD_INODE: read-ahead window, in blocks
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +21,8 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int nexec;          // regions of running programs that map it
+  struct inode *next; // hash chain in the inode table
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +31,13 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+
+  struct spage *shared; // pages mapped MAP_SHARED; see pcache.c
+
+  uint mapaddr;       // indirect block copied in map[], or 0
+  uint mapbase;       // file block number that map[0] is for
+  uint map[NINDIRECT];
 };
 
 // map major device number to device functions.
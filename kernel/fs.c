@@ -120,7 +120,9 @@ bfree(int dev, uint b)
 // to provide a place for synchronizing access
 // to inodes used by multiple processes. The in-memory
 // inodes include book-keeping information that is
-// not stored on disk: ip->ref and ip->valid.
+// not stored on disk: ip->ref and ip->valid. The table is
+// a hash table of inodes from a slab cache, so it holds as
+// many as memory allows.
 //
 // An inode and its in-memory representation go through a
 // sequence of states before they can be used by the
@@ -130,12 +132,11 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref,
+//   and frees the entry when it falls to zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -165,29 +166,30 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable.lock spin-lock protects the hash chains and the
+// allocation of itable entries. Since ip->ref indicates whether
+// an entry may be freed, and ip->dev and ip->inum indicate which
+// i-node an entry holds, one must hold itable.lock while using
+// any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kcache *cache;
+  struct inode *hash[NIHASH];
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kcachecreate("inode", sizeof(struct inode), 0);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -249,29 +251,40 @@ iget(uint dev, uint inum)
 {
   struct inode *ip, *empty;
 
-  acquire(&itable.lock);
-
-  // Is the inode already in the table?
   empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  acquire(&itable.lock);
+  for(;;){
+    // Is the inode already in the table?
+    for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        ip->ref++;
+        release(&itable.lock);
+        if(empty)
+          kcachefree(itable.cache, empty);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
+    if(empty)
+      break;
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+    // Allocate an entry, not with itable.lock held, since
+    // kalloc() may have to reclaim memory; then look again.
+    release(&itable.lock);
+    if((empty = kcachealloc(itable.cache)) == 0)
+      panic("iget: no inodes");
+    acquire(&itable.lock);
+  }
 
   ip = empty;
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
+  ip->nexec = 0;
   ip->valid = 0;
+  ip->shared = 0;
+  ip->next = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -288,6 +301,21 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Note that a region of a running program maps ip (n = 1),
+// or no longer does (n = -1). Since exec reads a program's pages
+// in as it touches them (see vmfault()), writei() fails while any
+// region maps the file, and so does open() for writing, as with
+// ETXTBSY elsewhere.
+void
+iexec(struct inode *ip, int n)
+{
+  acquire(&itable.lock);
+  ip->nexec += n;
+  if(ip->nexec < 0)
+    panic("iexec");
+  release(&itable.lock);
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -311,6 +339,7 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->mapaddr = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -328,8 +357,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -337,6 +366,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode **pp;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -358,8 +389,15 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&itable.lock);
+    return;
+  }
+  for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
   release(&itable.lock);
+  kcachefree(itable.cache, ip);
 }
 
 // Common idiom: unlock, then put.
@@ -397,7 +435,37 @@ ireclaim(int dev)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The NDINDIRECT blocks
+// after that are listed in the indirect blocks that are
+// listed in the doubly-indirect block ip->addrs[NDIRECT+1].
+//
+// The in-memory inode keeps a copy of the last indirect block
+// that bmap() looked up block numbers in, so that mapping a
+// run of consecutive blocks only reads each indirect block
+// once. Only bmap() and itrunc() change indirect blocks, with
+// ip->lock held, and they keep the copy up to date.
+
+// Return the address in entry i of the indirect block that
+// ip->map[] holds, allocating a block for it if there is none.
+// returns 0 if out of disk space.
+static uint
+mapentry(struct inode *ip, uint i)
+{
+  uint addr;
+  struct buf *bp;
+
+  if((addr = ip->map[i]) == 0){
+    addr = balloc(ip->dev);
+    if(addr){
+      bp = bread(ip->dev, ip->mapaddr);
+      ((uint*)bp->data)[i] = addr;
+      log_write(bp);
+      brelse(bp);
+      ip->map[i] = addr;
+    }
+  }
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -405,7 +473,7 @@ ireclaim(int dev)
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr, base, *a;
   struct buf *bp;
 
   if(bn < NDIRECT){
@@ -417,9 +485,13 @@ bmap(struct inode *ip, uint bn)
     }
     return addr;
   }
-  bn -= NDIRECT;
+  if(bn >= MAXFILE)
+    panic("bmap: out of range");
 
-  if(bn < NINDIRECT){
+  if(ip->mapaddr && bn >= ip->mapbase && bn - ip->mapbase < NINDIRECT)
+    return mapentry(ip, bn - ip->mapbase);
+
+  if(bn < NDIRECT + NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
       addr = balloc(ip->dev);
@@ -427,20 +499,60 @@ bmap(struct inode *ip, uint bn)
         return 0;
       ip->addrs[NDIRECT] = addr;
     }
+    base = NDIRECT;
+  } else {
+    // Load doubly-indirect block, and the indirect
+    // block in it, allocating if necessary.
+    if((addr = ip->addrs[NDIRECT+1]) == 0){
+      addr = balloc(ip->dev);
+      if(addr == 0)
+        return 0;
+      ip->addrs[NDIRECT+1] = addr;
+    }
+    base = bn - (bn - NDIRECT - NINDIRECT) % NINDIRECT;
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
+    if((addr = a[(base - NDIRECT - NINDIRECT) / NINDIRECT]) == 0){
       addr = balloc(ip->dev);
       if(addr){
-        a[bn] = addr;
+        a[(base - NDIRECT - NINDIRECT) / NINDIRECT] = addr;
         log_write(bp);
       }
     }
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
   }
 
-  panic("bmap: out of range");
+  bp = bread(ip->dev, addr);
+  memmove(ip->map, bp->data, sizeof(ip->map));
+  brelse(bp);
+  ip->mapaddr = addr;
+  ip->mapbase = base;
+  return mapentry(ip, bn - base);
+}
+
+// Free the blocks listed in indirect block addr, and addr.
+// If depth is 2, they are indirect blocks in turn.
+static void
+ifree(struct inode *ip, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j]){
+      if(depth > 1)
+        ifree(ip, a[j], depth - 1);
+      else
+        bfree(ip->dev, a[j]);
+    }
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -448,9 +560,10 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  pcacheinval(ip, 0, ip->size);
+  pcachetrunc(ip);
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -460,17 +573,16 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    ifree(ip, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    ifree(ip, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+  ip->mapaddr = 0;
+
   ip->size = 0;
   iupdate(ip);
 }
@@ -487,15 +599,36 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading blocks bn up to end of ip's content into the
+// buffer cache, without waiting for them.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint bn, uint end)
+{
+  uint addr, nblocks;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  if(end > nblocks)
+    end = nblocks;
+  for(; bn < end; bn++){
+    if((addr = bmap(ip, bn)) == 0)
+      break;
+    breada(ip->dev, addr);
+  }
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Bytes in a page that a process maps MAP_SHARED come from
+// that page, which may hold stores not yet written back.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *sp;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -503,11 +636,18 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if((sp = pcachefind(ip, off)) != 0){
+      if(either_copyout(user_dst, dst, sp + off % PGSIZE, m) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -525,16 +665,24 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // Returns the number of bytes successfully written.
 // If the return value is less than the requested n,
 // there was an error of some kind.
+// Pages that a process maps MAP_SHARED get the bytes too.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *sp;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  // a running program maps it. nexec only rises from zero
+  // in exec, with ip->lock held.
+  if(ip->nexec > 0)
+    return -1;
+
+  pcacheinval(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -547,6 +695,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       break;
     }
     log_write(bp);
+    if((sp = pcachefind(ip, off)) != 0)
+      memmove(sp + off % PGSIZE, bp->data + (off % BSIZE), m);
     brelse(bp);
   }
 
@@ -1,6 +1,37 @@
 // Physical memory allocator, for user processes,
-// kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// kernel stacks, page-table pages, pipe buffers,
+// and slabs (see slab.c). Allocates blocks of 2^order contiguous
+// 4096-byte pages, aligned to their size.
+//
+// Free memory is kept by a buddy allocator, with a free list
+// per order. kalloc_order() splits a larger block in halves
+// when its order's list is empty, and kfree_order() merges a
+// block with its buddy (the other half of the block one order
+// up) for as long as the buddy is free too.
+//
+// Most allocations are single pages, so each CPU keeps a small
+// cache of free pages, and the common kalloc()/kfree() path
+// only takes an uncontended per-CPU lock. Caches refill from,
+// and drain to, the buddy allocator KBATCH pages at a time. A
+// CPU whose cache and the buddy allocator are both empty steals
+// from other CPUs' caches.
+//
+// Every allocated block has a reference count, that of its
+// first page, so that copy-on-write fork can share a page
+// between page tables. kfree() and kfree_order() drop a
+// reference and free the block on the last one.
+//
+// Each CPU also keeps a pool of pages that are already zeroed,
+// filled by kzerofill() when the CPU has nothing to run, so that
+// kzalloc() can hand out a zeroed page without clearing it.
+//
+// Unless the kernel is built with NOJUNK, freed memory is filled
+// with junk to catch dangling references, and allocated memory
+// to catch uses of it before it is initialized.
+//
+// When no page is free, kalloc() asks the page cache to give
+// back the pages it holds that no process maps, and the slab
+// allocator its slabs with no object in use.
 
 #include "types.h"
 #include "param.h"
@@ -14,52 +45,307 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// pages moved between a CPU cache and the buddy allocator at once.
+#define KBATCH 32
+// a CPU cache holding more than this drains KBATCH pages.
+#define KCACHEMAX (2*KBATCH)
+
+// orders 0..NORDER-1; the largest block is 4 MB.
+#define NORDER 11
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define BLKSIZE(order) ((uint64)PGSIZE << (order))
+
 struct run {
   struct run *next;
+  struct run *prev;  // only in the buddy free lists
 };
 
+// buddy allocator.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *freelist[NORDER];
+  struct {
+    int nfree;       // blocks on the free list
+    uint nalloc;     // blocks handed out
+    uint nsplit;     // blocks split in two
+    uint nmerge;     // blocks merged with their buddy
+  } stat[NORDER];
 } kmem;
 
+// zeroed pages kept by each CPU.
+#define KZEROMAX 64
+
+// per-CPU caches of order-0 pages.
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  struct run *zerolist;  // zeroed pages
+  int nzero;
+} kcpu[NCPU];
+
+// reference counts, one per physical page, updated atomically.
+static int kref[NPAGE];
+
+// for each page that starts a block on a buddy free
+// list, the block's order plus one; else 0.
+// protected by kmem.lock.
+static char kord[NPAGE];
+
+#define PA2REF(pa) (&kref[((uint64)(pa) - KERNBASE) / PGSIZE])
+#define PA2ORD(pa) (&kord[((uint64)(pa) - KERNBASE) / PGSIZE])
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kcpu");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Put the block at r on the free list of its order.
+// Caller must hold kmem.lock.
+static void
+push(struct run *r, int order)
+{
+  r->prev = 0;
+  r->next = kmem.freelist[order];
+  if(r->next)
+    r->next->prev = r;
+  kmem.freelist[order] = r;
+  *PA2ORD(r) = order + 1;
+  kmem.stat[order].nfree++;
+}
+
+// Take the block at r off the free list of its order.
+// Caller must hold kmem.lock.
+static void
+unlink(struct run *r, int order)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  *PA2ORD(r) = 0;
+  kmem.stat[order].nfree--;
+}
+
+// Allocate a block of 2^order pages, splitting a
+// larger one if need be. Returns 0 if none is free.
+// Caller must hold kmem.lock.
+static struct run*
+buddyalloc(int order)
+{
+  struct run *r;
+  int o;
+
+  for(o = order; o < NORDER && kmem.freelist[o] == 0; o++)
+    ;
+  if(o == NORDER)
+    return 0;
+  r = kmem.freelist[o];
+  unlink(r, o);
+  while(o > order){
+    kmem.stat[o].nsplit++;
+    o--;
+    push((struct run*)((char*)r + BLKSIZE(o)), o);
+  }
+  kmem.stat[order].nalloc++;
+  return r;
+}
+
+// Free a block of 2^order pages, merging it with
+// its buddy for as long as the buddy is free.
+// Caller must hold kmem.lock.
+static void
+buddyfree(struct run *r, int order)
+{
+  uint64 pa, buddy;
+
+  pa = (uint64)r;
+  for(; order < NORDER-1; order++){
+    buddy = pa ^ BLKSIZE(order);
+    if(buddy < KERNBASE || buddy + BLKSIZE(order) > PHYSTOP ||
+       *PA2ORD(buddy) != order + 1)
+      break;
+    unlink((struct run*)buddy, order);
+    kmem.stat[order].nmerge++;
+    pa &= ~BLKSIZE(order);
+  }
+  push((struct run*)pa, order);
+}
+
+// Hand [pa_start, pa_end) to the buddy allocator, as the
+// largest aligned blocks that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p, e;
+  int o;
+
+  p = PGROUNDUP((uint64)pa_start);
+  e = (uint64)pa_end;
+  acquire(&kmem.lock);
+  while(p + PGSIZE <= e){
+    for(o = NORDER-1; o > 0; o--)
+      if(p % BLKSIZE(o) == 0 && p + BLKSIZE(o) <= e)
+        break;
+    push((struct run*)p, o);
+    p += BLKSIZE(o);
+  }
+  release(&kmem.lock);
+}
+
+// Detach up to n pages from the front of *list.
+// Returns the detached chain and sets *got to its length.
+static struct run*
+takebatch(struct run **list, int n, int *got)
+{
+  struct run *first, *r;
+  int i;
+
+  first = *list;
+  if(first == 0){
+    *got = 0;
+    return 0;
+  }
+  r = first;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *got = i;
+  return first;
+}
+
+// Return the last run in a non-empty chain.
+static struct run*
+lastrun(struct run *r)
+{
+  while(r->next)
+    r = r->next;
+  return r;
+}
+
+// Take up to KBATCH pages from the buddy allocator.
+// Returns the chain and sets *got to its length.
+static struct run*
+refill(int *got)
+{
+  struct run *batch, *r;
+  int n;
+
+  batch = 0;
+  acquire(&kmem.lock);
+  for(n = 0; n < KBATCH && (r = buddyalloc(0)) != 0; n++){
+    r->next = batch;
+    batch = r;
+  }
+  release(&kmem.lock);
+  *got = n;
+  return batch;
+}
+
+// Take pages from other CPUs' caches: half of the
+// first non-empty cache found, at most KBATCH.
+// Called without holding any kalloc lock.
+static struct run*
+steal(int id, int *got)
+{
+  struct run *r;
+  int i, j;
+
+  for(i = 1; i < NCPU; i++){
+    j = (id + i) % NCPU;
+    acquire(&kcpu[j].lock);
+    if(kcpu[j].nfree > 0){
+      int n = (kcpu[j].nfree + 1) / 2;
+      if(n > KBATCH)
+        n = KBATCH;
+      r = takebatch(&kcpu[j].freelist, n, got);
+      kcpu[j].nfree -= *got;
+      release(&kcpu[j].lock);
+      return r;
+    }
+    release(&kcpu[j].lock);
+  }
+  *got = 0;
+  return 0;
+}
+
+// Take a page from any CPU's pool of zeroed pages,
+// starting with this one's. Returns 0 if all are empty.
+static struct run*
+zerotake(int id)
+{
+  struct run *r;
+  int i, j;
+
+  for(i = 0; i < NCPU; i++){
+    j = (id + i) % NCPU;
+    acquire(&kcpu[j].lock);
+    if((r = kcpu[j].zerolist) != 0){
+      kcpu[j].zerolist = r->next;
+      kcpu[j].nzero--;
+      r->next = 0;
+    }
+    release(&kcpu[j].lock);
+    if(r)
+      return r;
+  }
+  return 0;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch;
+  int id, n, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(PA2REF(pa), 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  junk(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kcpu[id].lock);
+  r->next = kcpu[id].freelist;
+  kcpu[id].freelist = r;
+  kcpu[id].nfree++;
+  batch = 0;
+  if(kcpu[id].nfree > KCACHEMAX){
+    batch = takebatch(&kcpu[id].freelist, KBATCH, &n);
+    kcpu[id].nfree -= n;
+  }
+  release(&kcpu[id].lock);
+
+  if(batch){
+    acquire(&kmem.lock);
+    while(batch){
+      r = batch;
+      batch = r->next;
+      buddyfree(r, 0);
+    }
+    release(&kmem.lock);
+  }
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -67,16 +353,242 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  struct run *r, *batch;
+  int id, n;
+
+  push_off();
+  id = cpuid();
+
+  acquire(&kcpu[id].lock);
+  r = kcpu[id].freelist;
+  if(r){
+    kcpu[id].freelist = r->next;
+    kcpu[id].nfree--;
+  }
+  release(&kcpu[id].lock);
+
+  if(r == 0){
+    // refill from the buddy allocator, else steal from another
+    // CPU, else use a zeroed page.
+    batch = refill(&n);
+    if(batch == 0)
+      batch = steal(id, &n);
+    if(batch == 0 && (batch = zerotake(id)) != 0)
+      n = 1;
+    if(batch){
+      r = batch;
+      if(n > 1){
+        acquire(&kcpu[id].lock);
+        lastrun(r->next)->next = kcpu[id].freelist;
+        kcpu[id].freelist = r->next;
+        kcpu[id].nfree += n - 1;
+        release(&kcpu[id].lock);
+      }
+    }
+  }
+  pop_off();
+
+  if(r == 0 && pcachereclaim() + kcachereclaim() > 0)
+    return kalloc();
+
+  if(r){
+    *PA2REF(r) = 1;
+    junk((char*)r, 5, PGSIZE); // fill with junk
+  }
+  return (void*)r;
+}
+
+// Allocate one zeroed page of physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&kcpu[id].lock);
+  r = kcpu[id].zerolist;
+  if(r){
+    kcpu[id].zerolist = r->next;
+    kcpu[id].nzero--;
+  }
+  release(&kcpu[id].lock);
+  pop_off();
+
+  if(r == 0){
+    if((r = kalloc()) != 0)
+      memset(r, 0, PGSIZE);
+    return (void*)r;
+  }
+  r->next = 0;
+  *PA2REF(r) = 1;
+  return (void*)r;
+}
+
+// Zero a free page and add it to this CPU's pool for
+// kzalloc(), if the pool isn't full. Called by the
+// scheduler when it has nothing to run, with interrupts
+// off. Returns 1 if it zeroed a page, 0 if not.
+int
+kzerofill(void)
 {
   struct run *r;
+  int id;
+
+  id = cpuid();
+  acquire(&kcpu[id].lock);
+  if(kcpu[id].nzero >= KZEROMAX){
+    release(&kcpu[id].lock);
+    return 0;
+  }
+  if((r = kcpu[id].freelist) != 0){
+    kcpu[id].freelist = r->next;
+    kcpu[id].nfree--;
+  }
+  release(&kcpu[id].lock);
+
+  if(r == 0){
+    // a free single page, if there is one; splitting
+    // a larger block would cost superpages.
+    acquire(&kmem.lock);
+    if(kmem.freelist[0])
+      r = buddyalloc(0);
+    release(&kmem.lock);
+  }
+  if(r == 0)
+    return 0;
+
+  memset(r, 0, PGSIZE);
+  acquire(&kcpu[id].lock);
+  r->next = kcpu[id].zerolist;
+  kcpu[id].zerolist = r;
+  kcpu[id].nzero++;
+  release(&kcpu[id].lock);
+  return 1;
+}
+
+// Allocate 2^order contiguous pages of physical memory,
+// aligned to their size, with one reference count for the
+// whole block. Order 0 is kalloc(). Returns 0 if no block
+// that large is free; pages sitting in CPU caches and the
+// page cache are not given back to make one.
+void *
+kalloc_order(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order >= NORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = buddyalloc(order);
   release(&kmem.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    *PA2REF(r) = 1;
+    junk((char*)r, 5, BLKSIZE(order)); // fill with junk
+  }
   return (void*)r;
 }
+
+// Return how many blocks of 2^order pages the buddy allocator
+// could hand out: its free blocks of that order or larger,
+// counted in units of 2^order pages.
+int
+kfreeblocks(int order)
+{
+  int n = 0;
+
+  acquire(&kmem.lock);
+  for(int o = order; o < NORDER; o++)
+    n += kmem.stat[o].nfree << (o - order);
+  release(&kmem.lock);
+  return n;
+}
+
+// Drop a reference to the block of 2^order pages at pa,
+// which kalloc_order(order) returned, and free it on the
+// last one.
+void
+kfree_order(void *pa, int order)
+{
+  int ref;
+
+  if(order < 0 || order >= NORDER || ((uint64)pa % BLKSIZE(order)) != 0 ||
+     (char*)pa < end || (uint64)pa + BLKSIZE(order) > PHYSTOP)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+
+  ref = __sync_sub_and_fetch(PA2REF(pa), 1);
+  if(ref < 0)
+    panic("kfree_order: ref");
+  if(ref > 0)
+    return;
+
+  // Fill with junk to catch dangling refs.
+  junk(pa, 1, BLKSIZE(order));
+
+  acquire(&kmem.lock);
+  buddyfree((struct run*)pa, order);
+  release(&kmem.lock);
+}
+
+// Add a reference to an allocated page, e.g. when
+// uvmcopy() shares it copy-on-write.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(PA2REF(pa), 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefcnt");
+  return __atomic_load_n(PA2REF(pa), __ATOMIC_SEQ_CST);
+}
+
+// Turn the superpage at pa, with one reference, into
+// SUPERPGSIZE/PGSIZE separately allocated pages, each with
+// one reference, to be freed with kfree(). Freed pages merge
+// back into a superpage in the buddy allocator.
+void
+supersplit(void *pa)
+{
+  if(((uint64)pa % SUPERPGSIZE) != 0 || krefcnt(pa) != 1)
+    panic("supersplit");
+  for(int i = 1; i < SUPERPGSIZE / PGSIZE; i++)
+    *PA2REF((char*)pa + i*PGSIZE) = 1;
+}
+
+// Print the buddy allocator's statistics to the console.
+// Runs when user types ^F on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmemdump(void)
+{
+  int ncached = 0, nzero = 0;
+
+  printf("\norder  free  alloc  split  merge\n");
+  for(int o = 0; o < NORDER; o++)
+    printf("%d %d %d %d %d\n", o, kmem.stat[o].nfree,
+           kmem.stat[o].nalloc, kmem.stat[o].nsplit, kmem.stat[o].nmerge);
+  for(int i = 0; i < NCPU; i++){
+    ncached += kcpu[i].nfree;
+    nzero += kcpu[i].nzero;
+  }
+  printf("%d pages in CPU caches, %d zeroed\n", ncached, nzero);
+}
@@ -10,117 +10,213 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction is only closed when there are no FS
+// system calls active in it. Thus there is never any
+// reasoning required about whether a commit might write an
+// uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the open transaction is closed.
+//
+// The log is double-buffered. When the last system call of
+// the open transaction ends, the transaction is closed: its
+// blocks are copied out of the buffer cache into log.copy[],
+// and a new transaction opens at once and runs while the
+// closed one is written to the log, committed, and installed.
+// Only one process commits at a time; an end_op() that finds
+// a commit in progress leaves its transaction alone. When the
+// commit is done, the committing process hands the open
+// transaction off to the last of the system calls still running
+// in it, whose end_op() commits it, and only commits it itself
+// if none are; so no process commits on others' behalf for
+// long. System calls that end during a commit are grouped into
+// the following one.
+// LOGWINDOW (param.h) optionally holds a transaction open for
+// up to that many ticks so that more system calls can join it.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The on-disk log has two regions, used by commits in turn,
+// each in the format:
+//   header block, containing a sequence number, a checksum,
+//     and block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A commit writes its header and log blocks as one disk
+// request, and then installs the blocks as a second batch.
+// The checksum covers the header and the logged blocks, so
+// that recovery can tell whether the whole batch reached the
+// disk. Headers are not cleared after installing: recovery
+// replays every complete transaction still in the log, oldest
+// first, which leaves the disk as the newest one did.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint seq;    // commit sequence number
+  uint cksum;  // logsum() of the transaction
   int n;
   int block[LOGBLOCKS];
 };
 
+// first block of log region r.
+#define LOGREGION(r) (log.start + (r)*(LOGBLOCKS+1))
+
 struct log {
   struct spinlock lock;
   int start;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // a process is in committer().
+  int closing;     // committer() is closing lh, please wait.
+  int region;      // log region for the next commit.
+  uint opened;     // ticks when lh logged its first block.
+  uint seq;        // sequence number for the next commit.
   int dev;
-  struct logheader lh;
+  struct logheader lh;           // the open transaction.
+  struct buf *pinned[LOGBLOCKS]; // lh's pinned cache buffers.
+  struct logheader clh;          // the transaction being committed.
+  struct buf *cpinned[LOGBLOCKS];
+  struct buf copy[LOGBLOCKS];    // clh's blocks, outside the cache.
+  struct buf head;               // clh's header block.
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void committer(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog < 2*(LOGBLOCKS+1))
+    panic("initlog: log too small");
 
   initlock(&log.lock, "log");
+  for (i = 0; i < LOGBLOCKS; i++)
+    initsleeplock(&log.copy[i].lock, "logcopy");
+  initsleeplock(&log.head.lock, "loghead");
   log.start = sb->logstart;
   log.dev = dev;
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// FNV-1a hash of n bytes at p, continuing from h.
+static uint
+fnv(uint h, void *p, int n)
+{
+  uchar *c = p;
+
+  while(n-- > 0){
+    h ^= *c++;
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Checksum of a transaction: its header's sequence number
+// and block numbers, and the logged data[] of each block.
+static uint
+logsum(struct logheader *lh, uchar *data[])
+{
+  uint h = 2166136261;
+  int i;
+
+  h = fnv(h, &lh->seq, sizeof(lh->seq));
+  h = fnv(h, &lh->n, sizeof(lh->n));
+  h = fnv(h, lh->block, lh->n * sizeof(lh->block[0]));
+  for (i = 0; i < lh->n; i++)
+    h = fnv(h, data[i], BSIZE);
+  return h;
+}
+
+// Copy the transaction in log region r to its home locations,
+// through the buffer cache, if it reached the disk complete.
+// Only used by recovery.
+// Start all the writes before waiting for any of them.
 static void
-install_trans(int recovering)
+recover_trans(int r, struct logheader *lh)
 {
   int tail;
+  struct buf *lbufs[LOGBLOCKS], *dbufs[LOGBLOCKS];
+  uchar *data[LOGBLOCKS];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    if(recovering) {
-      printf("recovering tail %d dst %d\n", tail, log.lh.block[tail]);
-    }
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  if (lh->n <= 0 || lh->n > LOGBLOCKS)
+    return;
+  for (tail = 0; tail < lh->n; tail++) {
+    lbufs[tail] = bread(log.dev, LOGREGION(r)+tail+1); // read log block
+    data[tail] = lbufs[tail]->data;
+  }
+  if (logsum(lh, data) != lh->cksum) {
+    // crashed while writing the log; never installed.
+    for (tail = 0; tail < lh->n; tail++)
+      brelse(lbufs[tail]);
+    return;
+  }
+  for (tail = 0; tail < lh->n; tail++) {
+    printf("recovering tail %d dst %d\n", tail, lh->block[tail]);
+    struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
+    memmove(dbuf->data, data[tail], BSIZE);  // copy block to dst
+    brelse(lbufs[tail]);
+    bawrite(dbuf);  // start writing dst to disk
+    dbufs[tail] = dbuf;
+  }
+  for (tail = 0; tail < lh->n; tail++) {
+    biowait(dbufs[tail]);
+    brelse(dbufs[tail]);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the header of log region r from disk into *lh.
 static void
-read_head(void)
+read_head(int r, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  struct buf *buf = bread(log.dev, LOGREGION(r));
+  memmove(lh, buf->data, sizeof(*lh));
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Copy *lh into the header buffer, addressed to log region r.
+// The caller must hold log.head.lock.
 static void
-write_head(void)
+fill_head(int r, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
-  bwrite(buf);
-  brelse(buf);
+  log.head.dev = log.dev;
+  log.head.blockno = LOGREGION(r);
+  memmove(log.head.data, lh, sizeof(*lh));
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct logheader lh[2];
+  int r, first;
+
+  for (r = 0; r < 2; r++) {
+    read_head(r, &lh[r]);
+    if (lh[r].seq >= log.seq)
+      log.seq = lh[r].seq + 1;
+  }
+  first = lh[1].seq < lh[0].seq;
+  recover_trans(first, &lh[first]);  // replay the older commit
+  recover_trans(!first, &lh[!first]); // and then the newer
+  for (r = 0; r < 2; r++) {
+    if (lh[r].n != 0) {
+      // clear the log
+      lh[r].n = 0;
+      lh[r].cksum = logsum(&lh[r], 0);
+      acquiresleep(&log.head.lock);
+      fill_head(r, &lh[r]);
+      bwrite(&log.head);
+      releasesleep(&log.head.lock);
+    }
+  }
 }
 
 // called at the start of each FS system call.
@@ -129,10 +225,11 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGBLOCKS){
-      // this op might exhaust log space; wait for commit.
+      // this op might exhaust the open transaction's
+      // space; wait for it to be closed.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -143,69 +240,158 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and no other process is committing.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
+  if(log.outstanding == 0 && !log.committing && log.lh.n > 0){
     log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+    committer();
+    log.committing = 0;
   }
+  // begin_op() may be waiting for log space, and
+  // committer() for log.outstanding to drop to zero.
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Copy the closed transaction's blocks from the cache into
+// log.copy[]. Runs before any new FS system call may
+// modify them.
+static void
+snapshot(void)
+{
+  int tail;
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
+    acquiresleep(&log.copy[tail].lock);
+    log.copy[tail].dev = log.dev;
+    memmove(log.copy[tail].data, from->data, BSIZE);
+    brelse(from);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write the header and the copied blocks, which follow it
+// on disk, to log region r as one disk request, and wait.
+// This is the true point at which the closed transaction
+// commits.
 static void
-write_log(void)
+write_log(int r)
 {
   int tail;
+  uchar *data[LOGBLOCKS];
+  struct buf *bs[LOGBLOCKS+1];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    log.copy[tail].blockno = LOGREGION(r)+tail+1;
+    data[tail] = log.copy[tail].data;
+    bs[tail+1] = &log.copy[tail];
+  }
+  log.clh.seq = log.seq++;
+  log.clh.cksum = logsum(&log.clh, data);
+  acquiresleep(&log.head.lock);
+  fill_head(r, &log.clh);
+  bs[0] = &log.head;
+  bawritev(bs, log.clh.n+1);
+  for (tail = 0; tail < log.clh.n+1; tail++)
+    biowait(bs[tail]);
+  releasesleep(&log.head.lock);
+}
+
+// Write the copied blocks to their home locations, and
+// unpin the cache buffers. Runs of consecutive home blocks
+// go to the disk as one request each.
+// Start all the writes before waiting for any of them.
+static void
+install_trans(void)
+{
+  int tail, n;
+  struct buf *bs[LOGBLOCKS];
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    log.copy[tail].blockno = log.clh.block[tail];
+    bs[tail] = &log.copy[tail];
+  }
+  for (tail = 0; tail < log.clh.n; tail += n) {
+    for (n = 1; tail+n < log.clh.n; n++)
+      if (log.clh.block[tail+n] != log.clh.block[tail] + n)
+        break;
+    bawritev(&bs[tail], n);  // start writing dst to disk
+  }
+  for (tail = 0; tail < log.clh.n; tail++) {
+    biowait(&log.copy[tail]);
+    releasesleep(&log.copy[tail].lock);
+    bunpin(log.cpinned[tail]);
   }
 }
 
 static void
-commit()
+commit(int r)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  write_log(r);     // Write copied blocks and header -- the real commit
+  install_trans();  // Now install writes to home locations
+}
+
+// Close and commit the open transaction. If system calls
+// joined the next one meanwhile, return and leave it to the
+// end_op() of the last of them; if they have all ended
+// already, commit it too.
+// Called and returns with log.lock held, but not held
+// while waiting for the disk.
+static void
+committer(void)
+{
+  int r;
+
+  for(;;){
+    if(LOGWINDOW > 0){
+      // group commit: give more system calls a chance to
+      // join, unless the transaction is already full.
+      release(&log.lock);
+      acquire(&tickslock);
+      while(ticks - log.opened < LOGWINDOW &&
+            log.lh.n + MAXOPBLOCKS <= LOGBLOCKS)
+        sleep(&ticks, &tickslock);
+      release(&tickslock);
+      acquire(&log.lock);
+    }
+
+    // stop new system calls from joining and wait for
+    // the running ones to end.
+    log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+
+    log.clh = log.lh;
+    memmove(log.cpinned, log.pinned, sizeof(log.pinned));
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    r = log.region;
+    log.region ^= 1;
+    release(&log.lock);
+
+    snapshot();
+
+    // open the next transaction.
+    acquire(&log.lock);
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit(r);
+
+    acquire(&log.lock);
+    if(log.outstanding > 0 || log.lh.n == 0)
+      return;
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit()/install_trans() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -230,8 +416,10 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    log.pinned[i] = b;
+    if (log.lh.n == 0)
+      log.opened = ticks;
     log.lh.n++;
   }
   release(&log.lock);
 }
-
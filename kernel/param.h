@@ -5,14 +5,14 @@
 #endif
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // demand-paged regions per process
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in each on-disk log region
+#define LOGWINDOW    0   // ticks a log transaction waits for more FS ops to join
+#define NBUF         (MAXOPBLOCKS*12) // size of disk block cache
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
@@ -0,0 +1,311 @@
+// Page cache.
+//
+// The page cache holds physical pages with the contents of
+// file pages, keyed by (device, inode number, file offset),
+// so that processes running the same program map the same
+// physical pages for its text, and its data until they
+// write it (copy-on-write).
+//
+// Interface:
+// * pcacheget returns the page for a page-aligned file offset,
+//     reading it in if needed, with a reference for the caller.
+// * writei and itrunc call pcacheinval to drop pages whose
+//     file contents change. Processes that have the old page
+//     mapped keep it.
+// * kalloc calls pcachereclaim when memory runs out, to free
+//     the cached pages that no process has mapped.
+//
+// The cache holds a reference (see krefinc()) to each of its
+// pages, so a page is only mapped by processes while its
+// reference count is above one. Pages are only added and
+// invalidated with the inode's lock held, which keeps the cache
+// coherent with writei().
+//
+// MAP_SHARED mappings can't use these pages, since processes
+// write to them. Instead each inode has a list of shared pages
+// (ip->shared, protected by ip->lock), one per page-aligned file
+// offset that some process maps MAP_SHARED, and every process
+// that maps that offset maps the same page, so each sees the
+// others' stores at once:
+// * pcacheshare returns the shared page for an offset, reading
+//     it in if needed, with a reference for the caller, and
+//     pcacheunshare drops that reference, freeing the page when
+//     no process maps it any more.
+// * readi and writei use a shared page where there is one (see
+//     pcachefind), so that read() and write() agree with the
+//     mappings; a process that stored to a page writes it back
+//     to the file when it unmaps it (see vmaput()).
+// * itrunc calls pcachetrunc to zero them.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCACHE 512
+#define NPHASH 127
+#define PHASH(dev, inum, off) \
+  ((((dev) * 31 + (inum)) * 31 + (off) / PGSIZE) % NPHASH)
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint off;            // page-aligned file offset
+  char *pa;            // the page, or 0 if this entry is free
+  struct cpage *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct cpage page[NPCACHE];
+  struct cpage *hash[NPHASH];
+  int hand;            // next entry to consider replacing
+} pcache;
+
+struct spage {
+  uint off;            // page-aligned file offset
+  char *pa;
+  struct spage *next;  // next in ip->shared
+};
+
+static struct kcache *spagecache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  spagecache = kcachecreate("spage", sizeof(struct spage), 0);
+}
+
+// Look up a cached page. Caller must hold pcache.lock.
+static struct cpage*
+pfind(uint dev, uint inum, uint off)
+{
+  struct cpage *c;
+
+  for(c = pcache.hash[PHASH(dev, inum, off)]; c; c = c->next)
+    if(c->dev == dev && c->inum == inum && c->off == off)
+      return c;
+  return 0;
+}
+
+// Drop entry c and the cache's reference to its page.
+// Caller must hold pcache.lock.
+static void
+pdrop(struct cpage *c)
+{
+  struct cpage **pp;
+
+  for(pp = &pcache.hash[PHASH(c->dev, c->inum, c->off)]; *pp != c; pp = &(*pp)->next)
+    ;
+  *pp = c->next;
+  kfree(c->pa);
+  c->pa = 0;
+  c->next = 0;
+}
+
+// Find a free entry, replacing a page that no process
+// maps if need be. Returns 0 if every page is mapped.
+// Caller must hold pcache.lock.
+static struct cpage*
+pslot(void)
+{
+  struct cpage *c;
+
+  for(int n = 0; n < NPCACHE; n++){
+    c = &pcache.page[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCACHE;
+    if(c->pa == 0)
+      return c;
+    if(krefcnt(c->pa) == 1){
+      pdrop(c);
+      return c;
+    }
+  }
+  return 0;
+}
+
+// Return a page holding the PGSIZE bytes of ip at offset off,
+// which must be page-aligned, and lie within the file. The
+// caller gets a reference to the page, and must not change it.
+// Caller must hold ip->lock.
+// Returns 0 if out of memory or the read fails.
+char*
+pcacheget(struct inode *ip, uint off)
+{
+  struct cpage *c;
+  char *mem;
+
+  if(off % PGSIZE)
+    panic("pcacheget");
+
+  acquire(&pcache.lock);
+  if((c = pfind(ip->dev, ip->inum, off)) != 0){
+    mem = c->pa;
+    krefinc(mem);
+    release(&pcache.lock);
+    return mem;
+  }
+  release(&pcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  if(readi(ip, 0, (uint64)mem, off, PGSIZE) != PGSIZE){
+    kfree(mem);
+    return 0;
+  }
+
+  // No one can have added the page while we read it,
+  // since we hold ip->lock.
+  acquire(&pcache.lock);
+  if((c = pslot()) != 0){
+    c->dev = ip->dev;
+    c->inum = ip->inum;
+    c->off = off;
+    c->pa = mem;
+    c->next = pcache.hash[PHASH(ip->dev, ip->inum, off)];
+    pcache.hash[PHASH(ip->dev, ip->inum, off)] = c;
+    krefinc(mem);
+  }
+  // else the cache is full of mapped pages; the caller
+  // gets a page of its own.
+  release(&pcache.lock);
+  return mem;
+}
+
+// Drop the cached pages of ip that hold any of the n bytes
+// at offset off, since they are about to change.
+// Caller must hold ip->lock.
+void
+pcacheinval(struct inode *ip, uint off, uint n)
+{
+  struct cpage *c;
+  uint a;
+
+  if(n == 0)
+    return;
+  acquire(&pcache.lock);
+  if(n / PGSIZE < NPCACHE){
+    for(a = PGROUNDDOWN(off); a < off + n && a >= PGROUNDDOWN(off); a += PGSIZE)
+      if((c = pfind(ip->dev, ip->inum, a)) != 0)
+        pdrop(c);
+  } else {
+    for(c = pcache.page; c < &pcache.page[NPCACHE]; c++)
+      if(c->pa && c->dev == ip->dev && c->inum == ip->inum &&
+         c->off + PGSIZE > off && c->off < off + n)
+        pdrop(c);
+  }
+  release(&pcache.lock);
+}
+
+// Free the cached pages that no process maps.
+// Returns the number of pages freed.
+int
+pcachereclaim(void)
+{
+  struct cpage *c;
+  int n = 0;
+
+  acquire(&pcache.lock);
+  for(c = pcache.page; c < &pcache.page[NPCACHE]; c++){
+    if(c->pa && krefcnt(c->pa) == 1){
+      pdrop(c);
+      n++;
+    }
+  }
+  release(&pcache.lock);
+  return n;
+}
+
+// Return ip's shared page that holds byte off of the file,
+// or 0 if there is none. Caller must hold ip->lock.
+char*
+pcachefind(struct inode *ip, uint off)
+{
+  struct spage *s;
+
+  for(s = ip->shared; s; s = s->next)
+    if(s->off == PGROUNDDOWN(off))
+      return s->pa;
+  return 0;
+}
+
+// Return ip's shared page for the page-aligned offset off,
+// reading it in if there is none yet: the file's bytes there,
+// if any, and zeros after them. The caller gets a reference
+// to the page, and may write to it.
+// Caller must hold ip->lock.
+// Returns 0 if out of memory or the read fails.
+char*
+pcacheshare(struct inode *ip, uint off)
+{
+  struct spage *s;
+  char *mem;
+  uint n;
+
+  if(off % PGSIZE)
+    panic("pcacheshare");
+
+  if((mem = pcachefind(ip, off)) != 0){
+    krefinc(mem);
+    return mem;
+  }
+  if((s = kcachealloc(spagecache)) == 0)
+    return 0;
+  if((mem = kzalloc()) == 0){
+    kcachefree(spagecache, s);
+    return 0;
+  }
+  n = off < ip->size ? ip->size - off : 0;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if(n > 0 && readi(ip, 0, (uint64)mem, off, n) != n){
+    kfree(mem);
+    kcachefree(spagecache, s);
+    return 0;
+  }
+  s->off = off;
+  s->pa = mem;
+  s->next = ip->shared;
+  ip->shared = s;
+  krefinc(mem);  // the list's reference.
+  return mem;
+}
+
+// Drop the caller's reference to pa, ip's shared page for
+// offset off, and free the page if no other process maps it.
+// Caller must hold ip->lock.
+void
+pcacheunshare(struct inode *ip, uint off, char *pa)
+{
+  struct spage **pp, *s;
+
+  for(pp = &ip->shared; (s = *pp) != 0 && s->off != off; pp = &s->next)
+    ;
+  if(s == 0 || s->pa != pa)
+    panic("pcacheunshare");
+  // only a process that maps the page can add a reference
+  // to it, so two means just the caller's and the list's.
+  if(krefcnt(pa) == 2){
+    *pp = s->next;
+    kfree(pa);
+    kcachefree(spagecache, s);
+  }
+  kfree(pa);
+}
+
+// Zero ip's shared pages, since the file has been truncated.
+// Caller must hold ip->lock.
+void
+pcachetrunc(struct inode *ip)
+{
+  struct spage *s;
+
+  for(s = ip->shared; s; s = s->next)
+    memset(s->pa, 0, PGSIZE);
+}
@@ -8,17 +8,68 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Bytes written to a pipe are copied into its ring, one page
+// by default; fcntl(F_SETPIPE_SZ) grows it to as many as
+// PIPEMAXPAGES pages (see pipesize()). The ring's size is a
+// power of two, so that it divides 2^32 and nread and nwrite
+// can wrap around. A write of whole, page-aligned pages
+// instead lends them to the pipe (see uvmlend()), when the
+// ring is empty: the reader copies straight out of the
+// writer's pages, so the data is copied once, not twice. The
+// writer's pages become copy-on-write, so its later writes
+// don't change what the reader sees. The ring is empty while
+// any page is on loan, which keeps the bytes in order.
+//
+// splice() between a pipe and a file doesn't copy through a
+// buffer of its own: readi() fills the ring in place, between
+// pipewbegin() and pipewend(), and writei() drains it in place,
+// between piperbegin() and piperend(). wbusy and rbusy keep
+// other writers and readers out meanwhile, so nothing that
+// waits on another pipe may happen in between.
+
+#define PIPEMAXPAGES 16
+#define NLOAN 8
+
+struct loan {
+  uint64 pa;      // lent page
+  uint off;       // first unread byte
+};
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data[PIPEMAXPAGES];  // the ring's pages
+  uint size;      // bytes in the ring
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  struct loan loan[NLOAN];  // pages on loan, a queue
+  int loanhead;   // index of the oldest loan
+  int nloan;      // number of pages on loan
+  int wbusy;      // a splice is filling the ring
+  int rbusy;      // a splice is draining the pipe
 };
 
+static struct kcache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kcachecreate("pipe", sizeof(struct pipe), 0);
+}
+
+// Return the address of byte n of the stream in the ring, and
+// set *m to the number of bytes from there to the end of its page.
+static char*
+ring(struct pipe *pi, uint n, uint *m)
+{
+  n %= pi->size;
+  *m = PGSIZE - n % PGSIZE;
+  return pi->data[n / PGSIZE] + n % PGSIZE;
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +79,20 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kcachealloc(pipecache)) == 0)
     goto bad;
+  memset(pi->data, 0, sizeof(pi->data));
+  if((pi->data[0] = kalloc()) == 0)
+    goto bad;
+  pi->size = PGSIZE;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->loanhead = 0;
+  pi->nloan = 0;
+  pi->wbusy = 0;
+  pi->rbusy = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -46,8 +105,11 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
+  if(pi){
+    if(pi->data[0])
+      kfree(pi->data[0]);
+    kcachefree(pipecache, pi);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,63 +130,282 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    for(; pi->nloan > 0; pi->nloan--){
+      kfree((void*)pi->loan[pi->loanhead].pa);
+      pi->loanhead = (pi->loanhead + 1) % NLOAN;
+    }
+    for(int i = 0; i < PIPEMAXPAGES && pi->data[i]; i++)
+      kfree(pi->data[i]);
+    kcachefree(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// Write n bytes from addr, a user virtual address if
+// user_src is set, else a kernel address.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user_src, uint64 addr, int n)
 {
   int i = 0;
+  uint m;
+  uint64 pa;
+  char *dst;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
+      wakeupone(&pi->nwrite);  // pass on a wakeup meant for a writer.
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
+    if(user_src && n - i >= PGSIZE && (addr + i) % PGSIZE == 0 &&
+       !pi->wbusy && pi->nread == pi->nwrite && pi->nloan < NLOAN &&
+       (pa = uvmlend(pr->pagetable, addr + i)) != 0){
+      pi->loan[(pi->loanhead + pi->nloan) % NLOAN] = (struct loan){pa, 0};
+      pi->nloan++;
+      i += PGSIZE;
+      continue;
+    }
+    if(pi->wbusy || pi->nloan > 0 || pi->nwrite == pi->nread + pi->size){ //DOC: pipewrite-full
+      wakeupone(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // copy as much as fits in the ring's page.
+      dst = ring(pi, pi->nwrite, &m);
+      m = min(m, pi->size - (pi->nwrite - pi->nread));
+      m = min(m, n - i);
+      if(either_copyin(dst, user_src, addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
-  wakeup(&pi->nread);
+  wakeupone(&pi->nread);
+  if(pi->nloan == 0 && pi->nwrite < pi->nread + pi->size)
+    wakeupone(&pi->nwrite);  // room for another writer.
   release(&pi->lock);
 
   return i;
 }
 
+// Read up to n bytes to addr, a user virtual address if
+// user_dst is set, else a kernel address.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, int user_dst, uint64 addr, int n)
 {
   int i;
+  uint m;
+  char *src;
+  struct loan *l;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(pi->rbusy || (pi->nread == pi->nwrite && pi->nloan == 0 && pi->writeopen)){  //DOC: pipe-empty
     if(killed(pr)){
+      wakeupone(&pi->nread);  // pass on a wakeup meant for a reader.
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
+    if(pi->nloan > 0){
+      l = &pi->loan[pi->loanhead];
+      m = min(n - i, PGSIZE - l->off);
+      if(either_copyout(user_dst, addr + i, (char*)l->pa + l->off, m) == -1)
+        break;
+      l->off += m;
+      if(l->off == PGSIZE){
+        kfree((void*)l->pa);
+        pi->loanhead = (pi->loanhead + 1) % NLOAN;
+        pi->nloan--;
+      }
+    } else if(pi->nread != pi->nwrite){
+      src = ring(pi, pi->nread, &m);
+      m = min(m, pi->nwrite - pi->nread);
+      m = min(m, n - i);
+      if(either_copyout(user_dst, addr + i, src, m) == -1)
+        break;
+      pi->nread += m;
+    } else
       break;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakeupone(&pi->nwrite);  //DOC: piperead-wakeup
+  if(pi->nread != pi->nwrite || pi->nloan > 0)
+    wakeupone(&pi->nread);  // data left for another reader.
   release(&pi->lock);
   return i;
 }
+
+// Wait for room in the pipe, and reserve up to n contiguous
+// bytes of it for the caller to fill, at *dst.
+// Returns how many, or -1 if the read end is closed or the
+// process is killed. The caller must then call pipewend().
+int
+pipewbegin(struct pipe *pi, int n, char **dst)
+{
+  uint m;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  for(;;){
+    if(pi->readopen == 0 || killed(pr)){
+      wakeupone(&pi->nwrite);  // pass on a wakeup meant for a writer.
+      release(&pi->lock);
+      return -1;
+    }
+    if(!pi->wbusy && pi->nloan == 0 && pi->nwrite != pi->nread + pi->size)
+      break;
+    wakeupone(&pi->nread);
+    sleep(&pi->nwrite, &pi->lock);
+  }
+  pi->wbusy = 1;
+  *dst = ring(pi, pi->nwrite, &m);
+  m = min(m, pi->size - (pi->nwrite - pi->nread));
+  m = min(m, n);
+  release(&pi->lock);
+  return m;
+}
+
+// Add the first m bytes reserved by pipewbegin() to the pipe.
+void
+pipewend(struct pipe *pi, int m)
+{
+  acquire(&pi->lock);
+  pi->nwrite += m;
+  pi->wbusy = 0;
+  wakeupone(&pi->nread);
+  wakeupone(&pi->nwrite);
+  release(&pi->lock);
+}
+
+// Wait for data in the pipe, and point *src at up to n
+// contiguous bytes of it for the caller to copy.
+// Returns how many, 0 at end of file, or -1 if the process
+// is killed. Unless it returns 0 or -1, the caller must then
+// call piperend().
+int
+piperbegin(struct pipe *pi, int n, char **src)
+{
+  uint m;
+  struct loan *l;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(pi->rbusy || (pi->nread == pi->nwrite && pi->nloan == 0 && pi->writeopen)){
+    if(killed(pr)){
+      wakeupone(&pi->nread);  // pass on a wakeup meant for a reader.
+      release(&pi->lock);
+      return -1;
+    }
+    sleep(&pi->nread, &pi->lock);
+  }
+  if(pi->nloan > 0){
+    l = &pi->loan[pi->loanhead];
+    *src = (char*)l->pa + l->off;
+    m = PGSIZE - l->off;
+  } else if(pi->nread != pi->nwrite){
+    *src = ring(pi, pi->nread, &m);
+    m = min(m, pi->nwrite - pi->nread);
+  } else {
+    release(&pi->lock);
+    return 0;
+  }
+  pi->rbusy = 1;
+  m = min(m, n);
+  release(&pi->lock);
+  return m;
+}
+
+// Remove the first m bytes given out by piperbegin()
+// from the pipe; 0 leaves them there, for tee().
+void
+piperend(struct pipe *pi, int m)
+{
+  struct loan *l;
+
+  acquire(&pi->lock);
+  if(pi->nloan > 0){
+    l = &pi->loan[pi->loanhead];
+    l->off += m;
+    if(l->off == PGSIZE){
+      kfree((void*)l->pa);
+      pi->loanhead = (pi->loanhead + 1) % NLOAN;
+      pi->nloan--;
+    }
+  } else {
+    pi->nread += m;
+  }
+  pi->rbusy = 0;
+  wakeupone(&pi->nwrite);
+  wakeupone(&pi->nread);
+  release(&pi->lock);
+}
+
+// Return the size of the pipe's ring.
+int
+pipegetsize(struct pipe *pi)
+{
+  int n;
+
+  acquire(&pi->lock);
+  n = pi->size;
+  release(&pi->lock);
+  return n;
+}
+
+// Resize the pipe's ring to hold at least n bytes, rounded up
+// to a power-of-two number of pages.
+// Returns the new size, or -1 if n is too big or smaller
+// than the data now in the pipe, if a splice is using the
+// ring, or if out of memory.
+int
+pipesize(struct pipe *pi, int n)
+{
+  char *old[PIPEMAXPAGES], *dst, *src;
+  uint size, len, m, k;
+  int i, r = -1;
+
+  if(n < 0 || n > PIPEMAXPAGES*PGSIZE)
+    return -1;
+  for(size = PGSIZE; size < n; size *= 2)
+    ;
+  memset(old, 0, sizeof(old));
+  for(i = 0; i < size / PGSIZE; i++){
+    if((old[i] = kalloc()) == 0)
+      goto bad;
+  }
+
+  acquire(&pi->lock);
+  len = pi->nwrite - pi->nread;
+  if(len > size || pi->wbusy || pi->rbusy){
+    release(&pi->lock);
+    goto bad;
+  }
+  // move the unread bytes to the start of the new ring,
+  // and swap the rings, leaving the old one in old[].
+  for(k = 0; k < len; k += m){
+    src = ring(pi, pi->nread + k, &m);
+    dst = old[k / PGSIZE] + k % PGSIZE;
+    m = min(m, PGSIZE - k % PGSIZE);
+    m = min(m, len - k);
+    memmove(dst, src, m);
+  }
+  for(i = 0; i < PIPEMAXPAGES; i++){
+    dst = pi->data[i];
+    pi->data[i] = old[i];
+    old[i] = dst;
+  }
+  pi->size = size;
+  pi->nread = 0;
+  pi->nwrite = len;
+  wakeupone(&pi->nwrite);  // maybe more room for a writer.
+  release(&pi->lock);
+  r = size;
+
+ bad:
+  for(i = 0; i < PIPEMAXPAGES && old[i]; i++)
+    kfree(old[i]);
+  return r;
+}
@@ -8,17 +8,55 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
-
 struct proc *initproc;
 
+// Per-CPU run queues of RUNNABLE processes, in FIFO order.
+// setrun() puts a process on the queue of the CPU it last
+// ran on; a CPU with an empty queue steals from the others.
+// A run queue lock may be acquired while holding a p->lock,
+// but not the other way around.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+  int n;
+} runq[NCPU];
+
+// Wait queues of processes in sleep(), hashed by channel, in
+// the order they went to sleep, so that wakeup() only looks at
+// processes sleeping on channels in one bucket. A wait queue
+// lock may be acquired while holding the condition lock passed
+// to sleep(); a p->lock may be acquired while holding a wait
+// queue lock, but not the other way around.
+#define NWAITQ 61
+#define WAITQ(chan) (&waitq[((uint64)(chan) >> 2) % NWAITQ])
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+// procs come from a type-stable slab cache (see procctor()).
+// Each process has one of NPROC kernel stack slots, which caps
+// the number of processes. pid_lock protects nextpid, the
+// stack of free slots, and a hash table of procs by pid, which
+// kkill() and procdump() use. It may be acquired while holding
+// a p->lock, but not the other way around.
+#define NPIDHASH 61
+#define PIDHASH(pid) (&pidhash[(uint)(pid) % NPIDHASH])
+
 int nextpid = 1;
 struct spinlock pid_lock;
+struct proc *pidhash[NPIDHASH];
+static int freeslots[NPROC];
+static int nfreeslot;
+static struct kcache *proccache;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
@@ -26,38 +64,61 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
+// Construct a proc in the proc cache, once. The cache never
+// gives procs back to kalloc(), so kkill() can lock a proc it
+// found in the pid hash table after dropping pid_lock, even if
+// it has been freed meanwhile, and recheck p->pid.
+static void
+procctor(void *a)
 {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
+  struct proc *p = a;
+
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->state = UNUSED;
 }
 
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  proccache = kcachecreate("proc", sizeof(struct proc), procctor);
+  for(int i = NPROC-1; i >= 0; i--){
+    if(walk(kernel_pagetable, KSTACK(i), 1) == 0)
+      panic("procinit");
+    freeslots[nfreeslot++] = i;
   }
 }
 
+// Map a page for p's kernel stack slot the first time a process
+// uses it, with 4 KB PTEs, so that the invalid guard page below
+// it catches an overflow. The page stays mapped for the processes
+// that use the slot later, so no hart can hold a stale
+// translation for it. procinit() made the page-table pages, so
+// that allocproc()s on different harts don't race to make them.
+// Caller must hold p->lock.
+// Returns 0, or -1 if out of memory.
+static int
+kstackmap(struct proc *p)
+{
+  pte_t *pte = walk(kernel_pagetable, p->kstack, 0);
+  char *pa;
+
+  if(*pte & PTE_V)
+    return 0;
+  if((pa = kalloc()) == 0)
+    return -1;
+  *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_V;
+  sfence_vma();
+  return 0;
+}
+
 // Must be called with interrupts disabled,
 // to prevent race with process being moved
 // to a different CPU.
@@ -89,41 +150,56 @@ myproc(void)
   return p;
 }
 
-int
-allocpid()
+// Give p the next pid, and add it to the pid hash table.
+// Caller must hold p->lock.
+static void
+allocpid(struct proc *p)
 {
-  int pid;
-  
   acquire(&pid_lock);
-  pid = nextpid;
+  p->pid = nextpid;
   nextpid = nextpid + 1;
+  p->next = *PIDHASH(p->pid);
+  *PIDHASH(p->pid) = p;
   release(&pid_lock);
-
-  return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
+// Allocate a proc and a kernel stack slot for it.
+// If there are, initialize state required to run in the kernel,
 // and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// If there are no free slots, or a memory allocation fails, return 0.
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
+  int slot = -1;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  acquire(&pid_lock);
+  if(nfreeslot > 0)
+    slot = freeslots[--nfreeslot];
+  release(&pid_lock);
+  if(slot < 0)
+    return 0;
+  if((p = kcachealloc(proccache)) == 0){
+    acquire(&pid_lock);
+    freeslots[nfreeslot++] = slot;
+    release(&pid_lock);
+    return 0;
   }
-  return 0;
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
+  p->kstack = KSTACK(slot);
+  allocpid(p);
   p->state = USED;
+  p->cpu = cpuid();
+
+  // Map the kernel stack page, if not yet.
+  if(kstackmap(p) < 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -150,11 +226,16 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
-// p->lock must be held.
+// including user pages, and give it and its kernel stack slot
+// back. p must not be running, and must not be on its parent's
+// list of children.
+// p->lock must be held; the caller releases it afterwards,
+// which is safe since the proc cache is type-stable.
 static void
 freeproc(struct proc *p)
 {
+  struct proc **pp;
+
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
@@ -162,13 +243,27 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
-  p->pid = 0;
   p->parent = 0;
+  p->children = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  acquire(&pid_lock);
+  for(pp = PIDHASH(p->pid); *pp != p; pp = &(*pp)->next)
+    ;
+  *pp = p->next;
+  p->pid = 0;
+  p->next = 0;
+  // the slot whose stack is at p->kstack; see KSTACK().
+  freeslots[nfreeslot++] = (TRAMPOLINE - p->kstack) / (2*PGSIZE) - 1;
+  p->kstack = 0;
+  release(&pid_lock);
+
+  kcachefree(proccache, p);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -226,7 +321,7 @@ userinit(void)
   
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrun(p);
 
   release(&p->lock);
 }
@@ -272,6 +367,12 @@ kfork(void)
     return -1;
   }
   np->sz = p->sz;
+  if(vmacopy(p->pagetable, np->pagetable, p->vma) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  vmadup(np->vma, p->vma);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -293,10 +394,12 @@ kfork(void)
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrun(np);
   release(&np->lock);
 
   return pid;
@@ -307,14 +410,18 @@ kfork(void)
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
-
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  struct proc *pp, *next;
+
+  if(p->children == 0)
+    return;
+  for(pp = p->children; pp; pp = next){
+    next = pp->sibling;
+    pp->parent = initproc;
+    pp->sibling = initproc->children;
+    initproc->children = pp;
   }
+  p->children = 0;
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -328,6 +435,9 @@ kexit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and unmap mmap() regions.
+  vmaclose(p->pagetable, p->vma);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -339,6 +449,7 @@ kexit(int status)
 
   begin_op();
   iput(p->cwd);
+  vmafree(p->vma);
   end_op();
   p->cwd = 0;
 
@@ -367,37 +478,40 @@ kexit(int status)
 int
 kwait(uint64 addr)
 {
-  struct proc *pp;
+  struct proc *pp, **cp;
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the status is copied out with locks held.
+  if(addr != 0 && uvmprefault(addr, sizeof(int)) < 0)
+    return -1;
+
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through our children looking for exited ones.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
+    for(cp = &p->children; (pp = *cp) != 0; cp = &pp->sibling){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      havekids = 1;
+      if(pp->state == ZOMBIE){
+        // Found one.
+        pid = pp->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                sizeof(pp->xstate)) < 0) {
           release(&pp->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        *cp = pp->sibling;
+        freeproc(pp);
         release(&pp->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -411,10 +525,52 @@ kwait(uint64 addr)
   }
 }
 
+// Mark p RUNNABLE and put it on the run queue of p->cpu.
+// Caller must hold p->lock.
+void
+setrun(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  if(!holding(&p->lock))
+    panic("setrun");
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  acquire(&rq->lock);
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->n++;
+  release(&rq->lock);
+}
+
+// Take the process at the head of run queue rq, or return 0.
+static struct proc*
+runqget(struct runq *rq)
+{
+  struct proc *p;
+
+  if(rq->n == 0)  // peek without the lock; rechecked below.
+    return 0;
+  acquire(&rq->lock);
+  p = rq->head;
+  if(p){
+    rq->head = p->rqnext;
+    if(rq->head == 0)
+      rq->tail = 0;
+    rq->n--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run: the next one on this
+//    CPU's run queue, else one stolen from another's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -423,6 +579,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
   for(;;){
@@ -434,28 +591,35 @@ scheduler(void)
     intr_on();
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      asm volatile("wfi");
+    p = runqget(&runq[id]);
+    for(int i = 1; p == 0 && i < NCPU; i++)
+      p = runqget(&runq[(id + i) % NCPU]);
+    if(p == 0) {
+      // nothing to run; zero a free page for kzalloc(), or
+      // else stop running on this core until an interrupt.
+      if(kzerofill() == 0)
+        asm volatile("wfi");
+      continue;
     }
+
+    // p is on no run queue now, so no other CPU can choose
+    // it. It may still be switching out on the CPU that
+    // put it on the queue, until that CPU releases p->lock.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -492,7 +656,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrun(p);
   sched();
   release(&p->lock);
 }
@@ -540,47 +704,95 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
-  
-  // Must acquire p->lock in order to
+  struct waitq *wq = WAITQ(chan);
+  struct proc **pp;
+
+  // Join the end of chan's wait queue, and
+  // acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
+  // Once we are on the queue and hold p->lock,
+  // we can be guaranteed that we won't miss any
+  // wakeup (wakeup looks at the queue and then
+  // locks p->lock), so it's okay to release lk.
 
+  acquire(&wq->lock);
+  p->chan = chan;
+  p->wqnext = 0;
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext)
+    ;
+  *pp = p;
   acquire(&p->lock);  //DOC: sleeplock1
+  release(&wq->lock);
   release(lk);
 
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
 
   sched();
 
-  // Tidy up.
+  release(&p->lock);
+
+  // Tidy up: leave the wait queue.
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp != p; pp = &(*pp)->wqnext)
+    ;
+  *pp = p->wqnext;
   p->chan = 0;
+  release(&wq->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
-// Wake up all processes sleeping on channel chan.
-// Caller should hold the condition lock.
-void
-wakeup(void *chan)
+// Wake up processes sleeping on channel chan, all of them,
+// or only the one that has slept longest if one is set.
+// Returns the number woken.
+static int
+wake(void *chan, int one)
 {
+  struct waitq *wq = WAITQ(chan);
   struct proc *p;
+  int n = 0;
+
+  // No one can join the queue while the caller holds the
+  // condition lock, so an empty queue needs no locking.
+  if(wq->head == 0)
+    return 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  acquire(&wq->lock);
+  for(p = wq->head; p; p = p->wqnext){
+    if(p->chan == chan && p != myproc()){
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+      if(p->state == SLEEPING){
+        setrun(p);
+        n++;
       }
       release(&p->lock);
+      if(one && n > 0)
+        break;
     }
   }
+  release(&wq->lock);
+  return n;
+}
+
+// Wake up all processes sleeping on channel chan.
+// Caller should hold the condition lock.
+void
+wakeup(void *chan)
+{
+  wake(chan, 0);
+}
+
+// Wake up the process that has slept longest on channel chan,
+// for a condition that only one process can use at a time.
+// A process that wakes up and then does not use the condition
+// should call wakeupone() in turn.
+// Caller should hold the condition lock.
+void
+wakeupone(void *chan)
+{
+  wake(chan, 1);
 }
 
 // Kill the process with the given pid.
@@ -591,20 +803,28 @@ kkill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  acquire(&pid_lock);
+  for(p = *PIDHASH(pid); p && p->pid != pid; p = p->next)
+    ;
+  release(&pid_lock);
+  if(p == 0)
+    return -1;
+
+  acquire(&p->lock);
+  // p is still a proc even if it was freed meanwhile (see
+  // procctor()), and pids aren't reused, so if p->pid changed,
+  // the process exited.
+  if(p->pid != pid){
     release(&p->lock);
+    return -1;
+  }
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrun(p);
   }
-  return -1;
+  release(&p->lock);
+  return 0;
 }
 
 void
@@ -674,14 +894,14 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
-    printf("\n");
+  for(int i = 0; i < NPIDHASH; i++){
+    for(p = pidhash[i]; p; p = p->next){
+      if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      printf("%d %s %s", p->pid, state, p->name);
+      printf("\n");
+    }
   }
 }
@@ -79,6 +79,21 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region [start, end) of user memory whose pages vmfault()
+// fills in on first touch: the first filesz bytes from ip at
+// offset off, and zeros after that. Unused if end is 0.
+// Program segments lie below p->sz; regions made by mmap()
+// lie above it, below TRAPFRAME.
+struct vma {
+  uint64 start;                // page-aligned
+  uint64 end;
+  int perm;                    // PTE_W, PTE_X
+  struct inode *ip;            // file backing the region, or 0
+  uint off;                    // offset in ip of start
+  uint64 filesz;
+  int flags;                   // MAP_SHARED or MAP_PRIVATE if made by mmap(), else 0
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -87,13 +102,25 @@ struct proc {
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
-  int pid;                     // Process ID
+  int pid;                     // Process ID; pid_lock must be held too to change it
+  int cpu;                     // CPU whose run queue it goes on
+
+  // the lock of the run queue it is on protects this:
+  struct proc *rqnext;         // next in run queue
+
+  // the lock of chan's wait queue protects these:
+  void *chan;                  // If non-zero, sleeping on chan
+  struct proc *wqnext;         // next in wait queue
+
+  // pid_lock must be held when using this:
+  struct proc *next;           // next in pid hash chain
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // First child
+  struct proc *sibling;        // Next child of parent
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -103,5 +130,6 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-paged regions, e.g. program segments
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,320 @@
+// Slab allocator, for kernel objects smaller than a page:
+// pipes, open files, in-memory inodes, the records of shared
+// file pages, and processes.
+//
+// A cache hands out objects of one size. It carves pages from
+// kalloc() into slabs, each a header followed by as many
+// objects as fit, and keeps a list of the slabs that have a
+// free object. An object's slab is the page it lies in.
+//
+// Each CPU keeps a magazine of up to KMAG free objects per
+// cache, so that kcachealloc()/kcachefree() usually only take
+// an uncontended per-CPU lock. An empty magazine refills from
+// the slabs, and a full one flushes half of itself back,
+// KMAG/2 objects at a time.
+//
+// A cache keeps at most one slab whose objects are all free,
+// and gives the pages of others back to kalloc(). When no page
+// is free, kalloc() asks kcachereclaim() to flush the
+// magazines and give back every such slab.
+//
+// A cache made with a constructor is type-stable instead: the
+// constructor runs once on each object, when its slab is made,
+// and the cache never gives a slab back, so a freed object stays
+// an object of that type, in its constructed state, e.g. with an
+// initialized lock. Code that found an object without holding a
+// reference to it may still lock it and check whether it is the
+// one it was looking for. Its free link goes just past the
+// object rather than over the start of it, and objects are not
+// filled with junk.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKCACHE 8
+#define KMAG 16
+
+struct obj {
+  struct obj *next;
+};
+
+struct slab {
+  struct kcache *c;
+  struct slab *next;   // in c->slabs, if it has a free object
+  struct slab *prev;
+  struct obj *free;    // free objects
+  int inuse;           // objects handed out, or in a magazine
+};
+
+struct kcache {
+  struct spinlock lock;
+  char *name;
+  uint size;           // bytes per object and its free link, a multiple of 8
+  uint link;           // offset of the free link in a free object
+  void (*ctor)(void*); // constructor, if type-stable
+  int perslab;         // objects in a slab
+  struct slab *slabs;  // slabs with a free object
+  int nempty;          // slabs with every object free
+  struct {
+    struct spinlock lock;
+    int n;
+    void *obj[KMAG];
+  } mag[NCPU];         // per-CPU magazines
+};
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+// The free link of object p in cache c, and back.
+#define OBJLINK(c, p) ((struct obj*)((char*)(p) + (c)->link))
+#define LINKOBJ(c, o) ((void*)((char*)(o) - (c)->link))
+
+static struct kcache kcache[NKCACHE];
+static int nkcache;
+
+// Create a cache of objects of size bytes. If ctor isn't 0,
+// the cache is type-stable, and ctor constructs each object.
+// Called during boot, on one CPU.
+struct kcache*
+kcachecreate(char *name, uint size, void (*ctor)(void*))
+{
+  struct kcache *c;
+  uint link = 0;
+
+  size = (size + 7) & ~7;
+  if(ctor){
+    link = size;
+    size += sizeof(struct obj);
+  }
+  if(nkcache == NKCACHE || size < sizeof(struct obj) || size > PGSIZE - SLABHDR)
+    panic("kcachecreate");
+  c = &kcache[nkcache++];
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->link = link;
+  c->ctor = ctor;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, name);
+  return c;
+}
+
+// Put s at the front of c->slabs. Caller must hold c->lock.
+static void
+slablink(struct kcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->slabs;
+  if(s->next)
+    s->next->prev = s;
+  c->slabs = s;
+}
+
+// Take s off c->slabs. Caller must hold c->lock.
+static void
+slabunlink(struct kcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->slabs = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Take a free object from c's slabs, or return 0 if none
+// is free. Caller must hold c->lock.
+static void*
+slabtake(struct kcache *c)
+{
+  struct slab *s;
+  struct obj *o;
+
+  if((s = c->slabs) == 0)
+    return 0;
+  o = s->free;
+  s->free = o->next;
+  if(s->inuse++ == 0)
+    c->nempty--;
+  if(s->free == 0)
+    slabunlink(c, s);
+  return LINKOBJ(c, o);
+}
+
+// Return object p to its slab. If that leaves a second slab
+// with every object free, and c isn't type-stable, take it off
+// c->slabs and return it, for the caller to kfree(); else
+// return 0.
+// Caller must hold c->lock.
+static struct slab*
+slabput(struct kcache *c, void *p)
+{
+  struct slab *s;
+  struct obj *o;
+
+  s = (struct slab*)PGROUNDDOWN((uint64)p);
+  if(s->c != c || s->inuse < 1)
+    panic("kcachefree");
+  o = OBJLINK(c, p);
+  if(s->free == 0)
+    slablink(c, s);
+  o->next = s->free;
+  s->free = o;
+  if(--s->inuse > 0)
+    return 0;
+  if(c->nempty > 0 && c->ctor == 0){
+    slabunlink(c, s);
+    return s;
+  }
+  c->nempty++;
+  return 0;
+}
+
+// Add a slab to c. Returns -1 if out of memory.
+static int
+slabgrow(struct kcache *c)
+{
+  struct slab *s;
+  struct obj *o;
+  char *p;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return -1;
+  s->c = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(p = (char*)s + SLABHDR; p + c->size <= (char*)s + PGSIZE; p += c->size){
+    if(c->ctor)
+      c->ctor(p);
+    o = OBJLINK(c, p);
+    o->next = s->free;
+    s->free = o;
+  }
+  acquire(&c->lock);
+  slablink(c, s);
+  c->nempty++;
+  release(&c->lock);
+  return 0;
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory.
+void*
+kcachealloc(struct kcache *c)
+{
+  void *p;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+  if(c->mag[id].n == 0){
+    acquire(&c->lock);
+    while(c->mag[id].n < KMAG/2 && (p = slabtake(c)) != 0)
+      c->mag[id].obj[c->mag[id].n++] = p;
+    release(&c->lock);
+  }
+  p = 0;
+  if(c->mag[id].n > 0)
+    p = c->mag[id].obj[--c->mag[id].n];
+  release(&c->mag[id].lock);
+  pop_off();
+
+  if(p == 0){
+    if(slabgrow(c) == 0)
+      return kcachealloc(c);
+    // kalloc() failed, but reclaiming may have
+    // flushed objects from the magazines.
+    acquire(&c->lock);
+    p = slabtake(c);
+    release(&c->lock);
+  }
+  if(p && c->ctor == 0)
+    junk(p, 5, c->size); // fill with junk
+  return p;
+}
+
+// Free an object that kcachealloc(c) returned.
+void
+kcachefree(struct kcache *c, void *p)
+{
+  struct slab *s, *empty;
+  int id;
+
+  // Fill with junk to catch dangling refs.
+  if(c->ctor == 0)
+    junk(p, 1, c->size);
+
+  empty = 0;
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+  if(c->mag[id].n == KMAG){
+    acquire(&c->lock);
+    while(c->mag[id].n > KMAG/2){
+      if((s = slabput(c, c->mag[id].obj[--c->mag[id].n])) != 0){
+        s->next = empty;
+        empty = s;
+      }
+    }
+    release(&c->lock);
+  }
+  c->mag[id].obj[c->mag[id].n++] = p;
+  release(&c->mag[id].lock);
+  pop_off();
+
+  while((s = empty) != 0){
+    empty = s->next;
+    kfree(s);
+  }
+}
+
+// Flush every CPU's magazines, and free the slabs whose
+// objects are all free, but not those of type-stable caches.
+// Returns the number of pages freed.
+// Called by kalloc() when memory runs out.
+int
+kcachereclaim(void)
+{
+  struct kcache *c;
+  struct slab *s, *next, *empty;
+  int i, n;
+
+  n = 0;
+  for(c = kcache; c < &kcache[nkcache]; c++){
+    empty = 0;
+    for(i = 0; i < NCPU; i++){
+      acquire(&c->mag[i].lock);
+      acquire(&c->lock);
+      while(c->mag[i].n > 0){
+        if((s = slabput(c, c->mag[i].obj[--c->mag[i].n])) != 0){
+          s->next = empty;
+          empty = s;
+        }
+      }
+      release(&c->lock);
+      release(&c->mag[i].lock);
+    }
+    acquire(&c->lock);
+    for(s = c->slabs; s && c->ctor == 0; s = next){
+      next = s->next;
+      if(s->inuse == 0){
+        slabunlink(c, s);
+        c->nempty--;
+        s->next = empty;
+        empty = s;
+      }
+    }
+    release(&c->lock);
+    while((s = empty) != 0){
+      empty = s->next;
+      kfree(s);
+      n++;
+    }
+  }
+  return n;
+}
@@ -37,6 +37,11 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor and user mode read the cycle, time and
+  // instret counters, e.g. for benchmarks.
+  w_mcounteren(r_mcounteren() | 7);
+  w_scounteren(r_scounteren() | 7);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -1,13 +1,38 @@
 #include "types.h"
 
+// memset, memmove and memcmp work a 64-bit word at a time
+// once the pointers are 8-byte aligned, eight words per loop
+// iteration for memset and memmove. Bytes before the first
+// aligned word, and after the last, go one at a time. Whole
+// pages, as kalloc() returns, start aligned and have no
+// bytes left over, so zeroing or copying one is just the
+// eight-word loop. memmove and memcmp only use words when
+// both pointers have the same alignment.
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  if(n >= 16){
+    for(; (uint64)cdst % 8; n--)
+      *cdst++ = c;
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wdst = (uint64 *) cdst;
+    for(; n >= 64; n -= 64, wdst += 8){
+      wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+      wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
+    }
+    for(; n >= 8; n -= 8)
+      *wdst++ = w;
+    cdst = (char *) wdst;
   }
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -15,9 +40,22 @@ int
 memcmp(const void *v1, const void *v2, uint n)
 {
   const uchar *s1, *s2;
+  const uint64 *w1, *w2;
 
   s1 = v1;
   s2 = v2;
+  if(n >= 16 && ((uint64)s1 - (uint64)s2) % 8 == 0){
+    for(; (uint64)s1 % 8; n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    w1 = (const uint64 *) s1;
+    w2 = (const uint64 *) s2;
+    for(; n >= 8 && *w1 == *w2; n -= 8)
+      w1++, w2++;
+    // the bytes from here on include any difference.
+    s1 = (const uchar *) w1;
+    s2 = (const uchar *) w2;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,20 +70,60 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const uint64 *ws;
+  uint64 *wd, a0, a1, a2, a3, a4, a5, a6, a7;
+  int words;
 
   if(n == 0)
     return dst;
   
   s = src;
   d = dst;
+  words = n >= 16 && ((uint64)s - (uint64)d) % 8 == 0;
   if(s < d && s + n > d){
+    // overlapping, with src below dst: copy from the top down.
     s += n;
     d += n;
+    if(words){
+      for(; (uint64)d % 8; n--)
+        *--d = *--s;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 64; n -= 64){
+        ws -= 8;
+        wd -= 8;
+        a0 = ws[0]; a1 = ws[1]; a2 = ws[2]; a3 = ws[3];
+        a4 = ws[4]; a5 = ws[5]; a6 = ws[6]; a7 = ws[7];
+        wd[0] = a0; wd[1] = a1; wd[2] = a2; wd[3] = a3;
+        wd[4] = a4; wd[5] = a5; wd[6] = a6; wd[7] = a7;
+      }
+      for(; n >= 8; n -= 8)
+        *--wd = *--ws;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(words){
+      for(; (uint64)d % 8; n--)
+        *d++ = *s++;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 64; n -= 64, ws += 8, wd += 8){
+        a0 = ws[0]; a1 = ws[1]; a2 = ws[2]; a3 = ws[3];
+        a4 = ws[4]; a5 = ws[5]; a6 = ws[6]; a7 = ws[7];
+        wd[0] = a0; wd[1] = a1; wd[2] = a2; wd[3] = a3;
+        wd[4] = a4; wd[5] = a5; wd[6] = a6; wd[7] = a7;
+      }
+      for(; n >= 8; n -= 8)
+        *wd++ = *ws++;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -119,6 +119,57 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Move up to n bytes from fdin to fdout inside the kernel;
+// see filesplice().
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+// Copy up to n bytes from pipe fdin to pipe fdout without
+// consuming them; see filetee().
+uint64
+sys_tee(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filetee(in, out, n);
+}
+
+// Control an open file. The only commands so far get and set
+// the size of a pipe's buffer.
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg;
+
+  argint(1, &cmd);
+  argint(2, &arg);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_PIPE)
+    return -1;
+  switch(cmd){
+  case F_GETPIPE_SZ:
+    return pipegetsize(f->pipe);
+  case F_SETPIPE_SZ:
+    return pipesize(f->pipe, arg);
+  }
+  return -1;
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -341,6 +392,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program's file can't be written; see iexec().
+  if((omode & (O_WRONLY|O_RDWR|O_TRUNC)) && ip->nexec > 0){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -355,6 +413,9 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->raoff = 0;
+    f->ranext = 0;
+    f->rawin = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -503,3 +564,74 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Map len bytes of the file open as fd, from the page-aligned
+// offset off, into the process's memory at an address of the
+// kernel's choosing; the addr argument is only a hint, and is
+// ignored. Pages are read in when the process first touches
+// them (see vmfault()), and written back by munmap() or exit.
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, filesz;
+  int prot, flags, off;
+  struct file *f;
+  struct inode *ip;
+  struct vma *v;
+  struct proc *p = myproc();
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(argfd(4, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  if(len == 0 || len > MAXFILE*BSIZE || off < 0 || off % PGSIZE != 0)
+    return -1;
+  len = PGROUNDUP(len);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0)
+      break;
+  if(v == &p->vma[NVMA])
+    return -1;
+  if((addr = vmaplace(p, len)) == 0)
+    return -1;
+
+  ip = f->ip;
+  ilock(ip);
+  if(ip->type != T_FILE ||
+     (flags == MAP_SHARED && (prot & PROT_WRITE) && ip->nexec > 0)){
+    iunlock(ip);
+    return -1;
+  }
+  filesz = ip->size > off ? ip->size - off : 0;
+  iunlock(ip);
+
+  v->start = addr;
+  v->end = addr + len;
+  v->perm = ((prot & PROT_WRITE) ? PTE_W : 0) | ((prot & PROT_EXEC) ? PTE_X : 0);
+  v->ip = idup(ip);
+  v->off = off;
+  v->filesz = filesz < len ? filesz : len;
+  v->flags = flags;
+  return addr;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+  struct proc *p = myproc();
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return vmaunmap(p->pagetable, p->vma, addr, len);
+}
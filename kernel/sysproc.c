@@ -47,6 +47,10 @@ sys_sbrk(void)
   argint(1, &t);
   addr = myproc()->sz;
 
+  // don't grow the heap into an mmap() region.
+  if(n > 0 && (addr + n < addr || vmaoverlap(myproc()->vma, addr, addr + n)))
+    return -1;
+
   if(t == SBRK_EAGER || n < 0) {
     if(growproc(n) < 0) {
       return -1;
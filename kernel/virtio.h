@@ -47,7 +47,9 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// each request takes two plus one per block, so at least
+// NUM/3 requests can be in flight.
+#define NUM 128
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -7,6 +7,9 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -45,13 +48,12 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-  
   return kpgtbl;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table, with megapages
+// where va, pa and sz allow (see mappages()), which covers
+// the RAM above the kernel's first 2 MB and the PLIC.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
@@ -94,6 +96,8 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a megapage, return its level-1 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -103,11 +107,12 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -134,18 +139,41 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(*pte & PTE_S)
+    pa += PGROUNDDOWN(va) % SUPERPGSIZE;
   return pa;
 }
 
+// Return the level-1 PTE for va, where a megapage maps it.
+// If alloc!=0, create the level-1 page-table page if needed.
+static pte_t *
+walksuper(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if(*pte & PTE_V){
+    if(PTE_LEAF(*pte))
+      panic("walksuper");
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
-// physical addresses starting at pa.
+// physical addresses starting at pa. Each stretch of SUPERPGSIZE
+// bytes at which va and pa are both SUPERPGSIZE-aligned gets a
+// single megapage PTE, marked PTE_S.
 // va and size MUST be page-aligned.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
@@ -160,49 +188,105 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = va;
   last = va + size - PGSIZE;
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && last - a >= SUPERPGSIZE - PGSIZE){
+      sz = SUPERPGSIZE;
+      pte = walksuper(pagetable, a, 1);
+    } else {
+      sz = PGSIZE;
+      pte = walk(pagetable, a, 1);
+    }
+    if(pte == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
-    *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    *pte = PA2PTE(pa) | perm | PTE_V | (sz == SUPERPGSIZE ? PTE_S : 0);
+    if(a + sz > last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
+// Can a megapage map the SUPERPGSIZE-aligned va? Not if
+// any page in its range is mapped, or was (leaving a page
+// table behind).
+static int
+superok(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = walksuper(pagetable, va, 0);
+
+  return pte == 0 || *pte == 0;
+}
+
+// Replace the megapage that maps va, if any, with a page
+// table of ordinary PTEs with the same permissions, so that
+// part of it can be unmapped, shared or lent.
+// Returns 0, or -1 if out of memory.
+static int
+uvmdemote(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 pa;
+  uint flags;
+
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_S) == 0)
+    return 0;
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_S;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  supersplit((void*)pa);
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
-// Optionally free the physical memory.
+// Optionally free the physical memory. A megapage that is
+// only partly in the range is demoted to pages first.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end = va + npages*PGSIZE;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  for(a = va; a < end; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0) // leaf page table entry allocated?
       continue;   
     if((*pte & PTE_V) == 0)  // has physical page been allocated?
       continue;
+    if(*pte & PTE_S){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= end){
+        if(do_free)
+          kfree_order((void*)PTE2PA(*pte), SUPERORDER);
+        *pte = 0;
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      if(uvmdemote(pagetable, a) < 0)
+        panic("uvmunmap: demote");
+      pte = walk(pagetable, a, 0);
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -212,26 +296,36 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 }
 
 // Allocate PTEs and physical memory to grow a process from oldsz to
-// newsz, which need not be page aligned.  Returns new size or 0 on error.
+// newsz, which need not be page aligned. Aligned 2 MB stretches get
+// a megapage if the buddy allocator has a free 2 MB block.
+// Returns new size or 0 on error.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
   char *mem;
-  uint64 a;
+  uint64 a, sz;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
-  for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+  for(a = oldsz; a < newsz; a += sz){
+    sz = PGSIZE;
+    if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= newsz &&
+       superok(pagetable, a) && (mem = kalloc_order(SUPERORDER)) != 0){
+      sz = SUPERPGSIZE;
+      memset(mem, 0, sz);
+    } else
+      mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
-      kfree(mem);
+    if(mappages(pagetable, a, sz, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+      if(sz == SUPERPGSIZE)
+        kfree_order(mem, SUPERORDER);
+      else
+        kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
@@ -287,42 +381,57 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
-// returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
-int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+// Make new's pages in [start, end) the same as old's.
+// Unless share is set, writable pages become copy-on-write.
+// old's megapages are demoted to pages first, since
+// superpages aren't shared.
+// returns 0 on success, -1 on failure, after unmapping
+// any pages it mapped.
+static int
+copyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
       continue;   // page table entry hasn't been allocated
     if((*pte & PTE_V) == 0)
       continue;   // physical page hasn't been allocated
+    if(*pte & PTE_S){
+      if(uvmdemote(old, i) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(!share && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    krefinc((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Given a parent process's page table, make the
+// child's page table share its memory copy-on-write.
+// Writable pages become read-only with PTE_COW set in
+// both page tables; the first write to one of them
+// makes a private copy (see cowfault()).
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return copyrange(old, new, 0, sz, 0);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -336,6 +445,32 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Return the physical address of the user page at va, which
+// must be page-aligned, for copyin() and copyout(): one walk
+// in the common case that the page is mapped, accessible to
+// user mode and, if write is set, writable. Otherwise ask
+// vmfault() to fault it in, break copy-on-write sharing, or
+// note the first write to a MAP_SHARED page; it refuses
+// writes to read-only pages such as user text.
+// Returns 0 if va can't be accessed.
+static uint64
+uvmpage(pagetable_t pagetable, uint64 va, int write)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V) && (*pte & PTE_U) && (!write || (*pte & PTE_W))){
+    pa = PTE2PA(*pte);
+    if(*pte & PTE_S)
+      pa += va % SUPERPGSIZE;
+    return pa;
+  }
+  return vmfault(pagetable, va, !write);
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -343,25 +478,11 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
-  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
+    if((pa0 = uvmpage(pagetable, va0, 1)) == 0)
       return -1;
-  
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
-    }
-
-    pte = walk(pagetable, va0, 0);
-    // forbid copyout over read-only user text pages.
-    if((*pte & PTE_W) == 0)
-      return -1;
-      
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -384,12 +505,8 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
-    }
+    if((pa0 = uvmpage(pagetable, va0, 0)) == 0)
+      return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -402,20 +519,23 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
+// does the 64-bit word w have a zero byte?
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
+// until a '\0', or max. Aligned words without a '\0' are copied
+// a word at a time.
 // Return 0 on success, -1 on error.
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa0, w;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvmpage(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -423,6 +543,20 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
     char *p = (char *) (pa0 + (srcva - va0));
     while(n > 0){
+      if(n >= 8 && (uint64)p % 8 == 0){
+        w = *(uint64 *)p;
+        if(!HASZERO(w)){
+          if((uint64)dst % 8 == 0)
+            *(uint64 *)dst = w;
+          else
+            memmove(dst, p, 8);
+          n -= 8;
+          max -= 8;
+          p += 8;
+          dst += 8;
+          continue;
+        }
+      }
       if(*p == '\0'){
         *dst = '\0';
         got_null = 1;
@@ -445,33 +579,582 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
+// Return the region of process p that contains va, or 0.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Read the file contents of the page at va in region v
+// into mem, which is zeroed. May sleep.
+// Returns 0 on success, -1 on error.
+static int
+vmaread(struct vma *v, char *mem, uint64 va)
+{
+  uint64 n;
+  int r;
+
+  if(va - v->start >= v->filesz)
+    return 0;
+  n = v->filesz - (va - v->start);
+  if(n > PGSIZE)
+    n = PGSIZE;
+  ilock(v->ip);
+  r = readi(v->ip, 0, (uint64)mem, v->off + (va - v->start), n);
+  iunlock(v->ip);
+  return r == n ? 0 : -1;
+}
+
+// Can vmfault() fill a page of v from its file? Not if the
+// caller holds a spinlock, since that sleeps, nor if it holds
+// the file's inode lock, e.g. readi() into a mapping of the
+// same file, since that locks the inode.
+static int
+vmacansleep(struct vma *v)
+{
+  int noff;
+
+  push_off();
+  noff = mycpu()->noff;
+  pop_off();
+  return noff == 1 && !holdingsleep(&v->ip->lock);
+}
+
+// Return the page cache's page for va in region v, or 0 if
+// the page isn't a whole, page-aligned page of the file, in
+// which case the caller fills a page of its own. May sleep.
+static uint64
+vmacached(struct vma *v, uint64 va)
+{
+  uint off = v->off + (va - v->start);
+  char *mem;
+
+  if(v->ip == 0 || off % PGSIZE != 0 || va - v->start + PGSIZE > v->filesz)
+    return 0;
+  ilock(v->ip);
+  mem = pcacheget(v->ip, off);
+  iunlock(v->ip);
+  return (uint64)mem;
+}
+
+// Return the file's shared page for va in MAP_SHARED region v,
+// which every process that maps it shares (see pcacheshare()),
+// or 0 if out of memory. May sleep.
+static uint64
+vmashared(struct vma *v, uint64 va)
+{
+  char *mem;
+
+  ilock(v->ip);
+  mem = pcacheshare(v->ip, v->off + (va - v->start));
+  iunlock(v->ip);
+  return (uint64)mem;
+}
+
+#define SUPERPROMOTE 64  // heap pages faulted in before a megapage replaces them
+#define SUPERSPARE 8     // free megapages that promotion leaves alone
+
+// Replace the page table that maps the lazily allocated heap
+// around va with a megapage, once SUPERPROMOTE of its pages have
+// been faulted in, so that a sparsely touched heap doesn't cost
+// 2 MB per touch. Only when the 2 MB range lies below p->sz,
+// outside any region, every page in it is a private heap page,
+// and the buddy allocator has more than SUPERSPARE megapages
+// free, so that promotion doesn't use up the last of them.
+// Returns the physical address of va's page, or 0.
+static uint64
+uvmpromote(struct proc *p, uint64 va)
+{
+  uint64 base = va - va % SUPERPGSIZE, pa;
+  pte_t *pte;
+  pagetable_t pt;
+  char *mem;
+  int i, n = 0;
+
+  if(base + SUPERPGSIZE > p->sz || vmaoverlap(p->vma, base, base + SUPERPGSIZE))
+    return 0;
+  pte = walksuper(p->pagetable, base, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return 0;
+  pt = (pagetable_t)PTE2PA(*pte);
+  for(i = 0; i < 512; i++){
+    if(pt[i] == 0)
+      continue;
+    if((PTE_FLAGS(pt[i]) & ~(PTE_A|PTE_D)) != (PTE_V|PTE_R|PTE_W|PTE_U) ||
+       krefcnt((void*)PTE2PA(pt[i])) != 1)
+      return 0;
+    n++;
+  }
+  if(n < SUPERPROMOTE || kfreeblocks(SUPERORDER) <= SUPERSPARE)
+    return 0;
+  if((mem = kalloc_order(SUPERORDER)) == 0)
+    return 0;
+  for(i = 0; i < 512; i++){
+    if(pt[i] == 0){
+      memset(mem + i*PGSIZE, 0, PGSIZE);
+      continue;
+    }
+    pa = PTE2PA(pt[i]);
+    memmove(mem + i*PGSIZE, (char*)pa, PGSIZE);
+    kfree((void*)pa);
+  }
+  kfree(pt);
+  *pte = PA2PTE(mem) | PTE_V | PTE_R | PTE_W | PTE_U | PTE_S;
+  return (uint64)mem + (va - base);
+}
+
+static int
+pagezero(char *pa)
+{
+  uint64 *w = (uint64*)pa;
+
+  for(int i = 0; i < PGSIZE/sizeof(uint64); i++)
+    if(w[i] != 0)
+      return 0;
+  return 1;
+}
+
+// Give memory back when kalloc() fails: demote each megapage
+// that has all-zero pages in it to ordinary pages, and free
+// those pages but one, which becomes the new page table. They
+// refault as fresh zero pages if touched again. Only the
+// current process's own page table may be reclaimed, since
+// other harts may hold its translations in their TLBs; this
+// hart's is flushed on the way back to user space.
+// Returns the number of pages freed.
+static int
+uvmreclaim(pagetable_t pagetable)
+{
+  pagetable_t l1, pt;
+  pte_t *pte;
+  char *pa;
+  uint flags;
+  int i, j, k, z, n = 0;
+
+  for(i = 0; i < 512; i++){
+    if((pagetable[i] & PTE_V) == 0 || PTE_LEAF(pagetable[i]))
+      continue;
+    l1 = (pagetable_t)PTE2PA(pagetable[i]);
+    for(j = 0; j < 512; j++){
+      pte = &l1[j];
+      if((*pte & PTE_V) == 0 || (*pte & PTE_S) == 0)
+        continue;
+      pa = (char*)PTE2PA(*pte);
+      if(krefcnt(pa) != 1)
+        continue;
+      for(z = 0; z < 512 && !pagezero(pa + z*PGSIZE); z++)
+        ;
+      if(z == 512)
+        continue;
+      flags = PTE_FLAGS(*pte) & ~PTE_S;
+      supersplit(pa);
+      pt = (pagetable_t)(pa + z*PGSIZE);
+      for(k = 0; k < 512; k++){
+        if(k == z)
+          continue;
+        if(k > z && pagezero(pa + k*PGSIZE)){
+          kfree(pa + k*PGSIZE);
+          n++;
+        } else {
+          pt[k] = PA2PTE(pa + k*PGSIZE) | flags;
+        }
+      }
+      *pte = PA2PTE(pt) | PTE_V;
+    }
+  }
+  return n;
+}
+
 // allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
+// that was lazily allocated in sys_sbrk() or that is in one of
+// its regions, or give it a private copy of a copy-on-write page
+// it is writing. The pages of a MAP_SHARED region are the file's
+// shared pages, the same for every process that maps them; one
+// that is writable is mapped read-only until the first write to
+// it, so that PTE_W says which pages vmaput() must write back.
+// Other whole pages of a file come from the page cache, shared
+// with other processes: read-only, or copy-on-write if the region
+// is writable. Filling a page
+// from a file sleeps and locks the file's inode, so vmfault()
+// refuses to if the caller holds a spinlock or that inode's lock;
+// see uvmprefault(). A heap that is touched densely is moved
+// to megapages (see uvmpromote()), and when memory runs out the
+// zero pages of the process's megapages are given back (see
+// uvmreclaim()).
 // returns 0 if va is invalid or already mapped, or if
 // out of physical memory, and physical address if successful.
 uint64
 vmfault(pagetable_t pagetable, uint64 va, int read)
 {
-  uint64 mem;
+  uint64 mem, pa;
   struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  int perm = PTE_W;
 
-  if (va >= p->sz)
-    return 0;
   va = PGROUNDDOWN(va);
-  if(ismapped(pagetable, va)) {
+  v = vmalookup(p, va);
+  if (va >= p->sz && v == 0)
     return 0;
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    if(read == 0 && (*pte & PTE_COW))
+      return cowfault(pagetable, va);
+    if(read == 0 && v && (v->flags & MAP_SHARED) && (v->perm & PTE_W) &&
+       (*pte & PTE_W) == 0){
+      *pte |= PTE_W;
+      return PTE2PA(*pte);
+    }
+    return 0;
+  }
+  if(v){
+    if(read == 0 && (v->perm & PTE_W) == 0)
+      return 0;
+    if(v->ip && ((v->flags & MAP_SHARED) || va - v->start < v->filesz) &&
+       !vmacansleep(v))
+      return 0;
+    perm = v->perm;
+    if(v->flags & MAP_SHARED){
+      if(read)
+        perm &= ~PTE_W;
+      if((mem = vmashared(v, va)) == 0)
+        return 0;
+      if(mappages(p->pagetable, va, PGSIZE, mem, perm|PTE_U|PTE_R) != 0){
+        ilock(v->ip);
+        pcacheunshare(v->ip, v->off + (va - v->start), (char *)mem);
+        iunlock(v->ip);
+        return 0;
+      }
+      return mem;
+    }
+    if((mem = vmacached(v, va)) != 0){
+      if(perm & PTE_W)
+        perm = (perm & ~PTE_W) | PTE_COW;
+      if(mappages(p->pagetable, va, PGSIZE, mem, perm|PTE_U|PTE_R) != 0){
+        kfree((void *)mem);
+        return 0;
+      }
+      if(read == 0 && (perm & PTE_COW))
+        return cowfault(pagetable, va);
+      return mem;
+    }
   }
-  mem = (uint64) kalloc();
+  if((mem = (uint64) kzalloc()) == 0 && uvmreclaim(pagetable) > 0)
+    mem = (uint64) kzalloc();
   if(mem == 0)
     return 0;
-  memset((void *) mem, 0, PGSIZE);
-  if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
+  if(v && v->ip && vmaread(v, (char *) mem, va) < 0){
     kfree((void *)mem);
     return 0;
   }
+  if (mappages(p->pagetable, va, PGSIZE, mem, perm|PTE_U|PTE_R) != 0) {
+    kfree((void *)mem);
+    return 0;
+  }
+  if(v == 0 && (pa = uvmpromote(p, va)) != 0)
+    return pa;
   return mem;
 }
 
+// Fault in the file-backed pages in the current process's
+// user memory [va, va+len) that aren't mapped yet: those of
+// a MAP_SHARED region, and the others' within the file. A system
+// call that will copyin() or copyout() while holding a spinlock
+// or an inode lock calls this first, since vmfault() won't fill
+// such a page then (see vmacansleep()).
+// Returns 0, or -1 if a page couldn't be faulted in, in which
+// case the system call should fail before taking any lock.
+int
+uvmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+
+  if(va + len < va)
+    return -1;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->ip == 0)
+      continue;
+    a = PGROUNDDOWN(va > v->start ? va : v->start);
+    end = (v->flags & MAP_SHARED) ? v->end : v->start + v->filesz;
+    if(va + len < end)
+      end = va + len;
+    for(; a < end; a += PGSIZE)
+      if(walkaddr(p->pagetable, a) == 0 && vmfault(p->pagetable, a, 1) == 0)
+        return -1;
+  }
+  return 0;
+}
+
+// Copy the regions in from[] to to[], e.g. for fork.
+void
+vmadup(struct vma *to, struct vma *from)
+{
+  for(int i = 0; i < NVMA; i++){
+    to[i] = from[i];
+    if(to[i].ip)
+      idup(to[i].ip);
+    if(to[i].ip && to[i].flags == 0)
+      iexec(to[i].ip, 1);
+  }
+}
+
+// Drop all the regions in vma[] and their inode references.
+// Must be called inside a transaction, since iput() may be
+// the last reference to an unlinked file.
+void
+vmafree(struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++){
+    if(vma[i].ip && vma[i].flags == 0)
+      iexec(vma[i].ip, -1);
+    if(vma[i].ip)
+      iput(vma[i].ip);
+    memset(&vma[i], 0, sizeof(vma[i]));
+  }
+}
+
+// Does any region in vma[] overlap [start, end)?
+int
+vmaoverlap(struct vma *vma, uint64 start, uint64 end)
+{
+  for(int i = 0; i < NVMA; i++)
+    if(vma[i].end != 0 && start < vma[i].end && vma[i].start < end)
+      return 1;
+  return 0;
+}
+
+// Find room for an mmap() region of len bytes, a multiple of
+// PGSIZE, between the top of p's memory and TRAPFRAME, as high
+// as possible so that sbrk() can keep growing the heap.
+// Returns its address, or 0 if there's no room.
+uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  uint64 a = TRAPFRAME;
+  struct vma *v;
+
+ again:
+  if(len > a || a - len < PGROUNDUP(p->sz))
+    return 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end != 0 && v->start < a && a - len < v->end){
+      a = v->start;
+      goto again;
+    }
+  }
+  return a - len;
+}
+
+// Unmap and free the page at va in mmap() region v. A page of
+// a MAP_SHARED region is first written back to the file, as far
+// as the file goes, if the process wrote it, and then dropped
+// from the file's shared pages if no one else maps it.
+// Must not be called in a transaction.
+static void
+vmaput(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa, n;
+  uint off;
+  int dirty;
+
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    return;
+  pa = PTE2PA(*pte);
+  if((v->flags & MAP_SHARED) == 0){
+    *pte = 0;
+    kfree((void*)pa);
+    return;
+  }
+  off = v->off + (va - v->start);
+  dirty = (*pte & PTE_W) != 0;
+  if(dirty)
+    begin_op();
+  ilock(v->ip);
+  if(dirty && off < v->ip->size){
+    n = v->ip->size - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    writei(v->ip, 0, pa, off, n);
+  }
+  *pte = 0;
+  pcacheunshare(v->ip, off, (char*)pa);
+  iunlock(v->ip);
+  if(dirty)
+    end_op();
+}
+
+// Drop the first n bytes of region v, a multiple of PGSIZE.
+static void
+vmatrim(struct vma *v, uint64 n)
+{
+  v->start += n;
+  v->off += n;
+  v->filesz = v->filesz > n ? v->filesz - n : 0;
+}
+
+// Unmap [va, va+len) of the mmap() region in vma[] that holds
+// it, writing back pages as vmaput() does. The range may be all
+// of the region, its start or end, or a hole in the middle if
+// there's a free slot for the part after the hole.
+// Must not be called in a transaction.
+// Returns 0 on success, -1 if the range isn't within a region.
+int
+vmaunmap(pagetable_t pagetable, struct vma *vma, uint64 va, uint64 len)
+{
+  struct vma *v, *w = 0;
+  uint64 a, end;
+
+  if(va % PGSIZE != 0 || len == 0 || va + len < va)
+    return -1;
+  end = PGROUNDUP(va + len);
+  for(v = vma; v < &vma[NVMA]; v++)
+    if(v->end != 0 && v->flags != 0 && va >= v->start && va < v->end)
+      break;
+  if(v == &vma[NVMA] || end > v->end)
+    return -1;
+  if(va > v->start && end < v->end){
+    for(w = vma; w < &vma[NVMA] && w->end != 0; w++)
+      ;
+    if(w == &vma[NVMA])
+      return -1;
+  }
+
+  for(a = va; a < end; a += PGSIZE)
+    vmaput(pagetable, v, a);
+
+  if(w){
+    // the part after the hole becomes a region of its own.
+    *w = *v;
+    vmatrim(w, end - v->start);
+    idup(w->ip);
+  }
+  if(va == v->start && end == v->end){
+    begin_op();
+    iput(v->ip);
+    end_op();
+    memset(v, 0, sizeof(*v));
+  } else if(va == v->start){
+    vmatrim(v, end - va);
+  } else {
+    v->end = va;
+    if(v->filesz > va - v->start)
+      v->filesz = va - v->start;
+  }
+  return 0;
+}
+
+// Unmap all the mmap() regions in vma[], e.g. on exit.
+// Must not be called in a transaction.
+void
+vmaclose(pagetable_t pagetable, struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++)
+    if(vma[i].end != 0 && vma[i].flags != 0)
+      vmaunmap(pagetable, vma, vma[i].start, vma[i].end - vma[i].start);
+}
+
+// Give new the pages of the mmap() regions in vma[] that old
+// has mapped, for fork: the same pages for MAP_SHARED regions,
+// copy-on-write ones for MAP_PRIVATE regions.
+// returns 0 on success, -1 on failure, after unmapping
+// any pages it mapped.
+int
+vmacopy(pagetable_t old, pagetable_t new, struct vma *vma)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    if(vma[i].end == 0 || vma[i].flags == 0)
+      continue;
+    if(copyrange(old, new, vma[i].start, vma[i].end, vma[i].flags & MAP_SHARED) < 0)
+      goto err;
+  }
+  return 0;
+
+ err:
+  while(--i >= 0)
+    if(vma[i].end != 0 && vma[i].flags != 0)
+      uvmunmap(new, vma[i].start, (vma[i].end - vma[i].start) / PGSIZE, 1);
+  return -1;
+}
+
+// Give the process a private, writable copy of the
+// copy-on-write page at va, or just make the page
+// writable if no other page table shares it.
+// returns the page's new physical address, or 0 if
+// va isn't a COW page or out of physical memory.
+uint64
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return 0;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    // no one else shares it any more.
+    *pte = PA2PTE(pa) | flags;
+    return pa;
+  }
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return (uint64)mem;
+}
+
+// Lend the user page at va, e.g. to a pipe: make it
+// copy-on-write, so that the process's later writes go to a
+// copy, and return its physical address with a reference for
+// the borrower, who must not write it. Only pages private to
+// the process can be lent.
+// returns 0 if the page isn't mapped or can't be lent.
+uint64
+uvmlend(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  struct vma *v;
+  uint64 pa;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    return 0;
+  if(*pte & PTE_S){
+    if(uvmdemote(pagetable, va) < 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+  }
+  if((*pte & (PTE_W|PTE_COW)) == 0)
+    return 0;
+  if((v = vmalookup(myproc(), va)) != 0 && (v->flags & MAP_SHARED))
+    return 0;
+  if(*pte & PTE_W)
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+  pa = PTE2PA(*pte);
+  krefinc((void*)pa);
+  return pa;
+}
+
 int
 ismapped(pagetable_t pagetable, uint64 va)
 {
@@ -0,0 +1,63 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+// Measure how physical page allocation throughput scales with
+// the number of CPUs allocating at once. Each of nproc workers
+// repeatedly grows its heap by NPAGES pages (kalloc) and then
+// shrinks it again (kfree). Run with CPUS=8 to see 1..8.
+//   allocbench [maxproc]
+
+#define NPAGES 64
+#define ROUNDS 100
+
+void
+worker(void)
+{
+  for(int i = 0; i < ROUNDS; i++){
+    if(sbrk(NPAGES*PGSIZE) == SBRK_ERROR){
+      printf("allocbench: sbrk failed\n");
+      exit(1);
+    }
+    sbrk(-NPAGES*PGSIZE);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxproc = 8;
+  int nproc, i, t0, t1, xstatus;
+
+  if(argc > 1)
+    maxproc = atoi(argv[1]);
+
+  for(nproc = 1; nproc <= maxproc; nproc++){
+    t0 = uptime();
+    for(i = 0; i < nproc; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("allocbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        worker();
+    }
+    for(i = 0; i < nproc; i++){
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(1);
+    }
+    t1 = uptime();
+    if(t1 == t0)
+      t1 = t0 + 1;
+    // two allocator calls (kalloc, kfree) per page per round;
+    // a tick is about 1/10th of a second.
+    int pages = nproc * ROUNDS * NPAGES;
+    printf("allocbench: %d procs: %d pages in %d ticks, %d pages/sec\n",
+           nproc, pages, t1 - t0, pages * 10 / (t1 - t0));
+  }
+  exit(0);
+}
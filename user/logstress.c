@@ -13,9 +13,10 @@ char buf[BUFSZ];
 int
 main(int argc, char **argv)
 {
-  int fd, n;
+  int fd, n, t0, t1;
   enum { N = 250, SZ=2000 };
   
+  t0 = uptime();
   for (int i = 1; i < argc; i++){
     int pid1 = fork();
     if(pid1 < 0){
@@ -44,5 +45,11 @@ main(int argc, char **argv)
     if(xstatus != 0)
       exit(xstatus);
   }
+  t1 = uptime();
+  if(t1 == t0)
+    t1 = t0 + 1;
+  // a tick is about 1/10th of a second.
+  printf("%s: %d writes in %d ticks, %d writes/sec\n", argv[0],
+         (argc-1)*N, t1-t0, (argc-1)*N*10/(t1-t0));
   return 0;
 }
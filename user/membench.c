@@ -0,0 +1,71 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+// Measure memset, memmove and memcmp throughput, in bytes
+// per clock cycle, for a range of sizes, with buffers that
+// are 8-byte aligned and with buffers that are not. Each
+// measurement moves about mbytes megabytes.
+//   membench [mbytes]
+
+#define MAXSZ (16*PGSIZE)
+
+char a[MAXSZ + 8];
+char b[MAXSZ + 8];
+
+// print bytes/cycles with two decimals.
+void
+report(char *name, int sz, char *align, uint64 bytes, uint64 cycles)
+{
+  uint64 x;
+
+  if(cycles == 0)
+    cycles = 1;
+  x = bytes * 100 / cycles;
+  printf("membench: %s %d %s: %d.%d%d bytes/cycle\n", name, sz, align,
+         (int)(x / 100), (int)(x / 10 % 10), (int)(x % 10));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 16, 64, 512, PGSIZE, MAXSZ };
+  int mb = 4, i, j, n, sz, off;
+  uint64 t0, t1, total;
+  char *align;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  total = (uint64)mb * 1024 * 1024;
+
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    sz = sizes[i];
+    n = total / sz;
+    for(off = 0; off < 2; off++){
+      align = off ? "unaligned" : "aligned";
+
+      t0 = r_cycle();
+      for(j = 0; j < n; j++)
+        memset(a + off, j, sz);
+      t1 = r_cycle();
+      report("memset", sz, align, (uint64)n * sz, t1 - t0);
+
+      t0 = r_cycle();
+      for(j = 0; j < n; j++)
+        memmove(b + off, a + off, sz);
+      t1 = r_cycle();
+      report("memmove", sz, align, (uint64)n * sz, t1 - t0);
+
+      t0 = r_cycle();
+      for(j = 0; j < n; j++)
+        if(memcmp(a + off, b + off, sz) != 0){
+          printf("membench: memcmp saw a difference\n");
+          exit(1);
+        }
+      t1 = r_cycle();
+      report("memcmp", sz, align, (uint64)n * sz, t1 - t0);
+    }
+  }
+  exit(0);
+}
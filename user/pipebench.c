@@ -0,0 +1,84 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Measure pipe throughput: a child writes kbytes through a
+// pipe to its parent, in writes of 512 bytes and of a
+// page-aligned 1 and 32 pages, and the parent reads it with
+// reads of the same size. pipesize, if given, sets the size
+// of the pipe's buffer with fcntl(F_SETPIPE_SZ).
+//   pipebench [kbytes [pipesize]]
+
+#define MAXSZ (32*PGSIZE)
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 512, PGSIZE, MAXSZ };
+  int kb = 1024, pipesz = 0, psz;
+  int fds[2], i, n, sz, pid, total, t0, t1;
+  char *buf;
+
+  if(argc > 1)
+    kb = atoi(argv[1]);
+  if(argc > 2)
+    pipesz = atoi(argv[2]);
+  total = kb * 1024;
+
+  // page-aligned, so that big writes can lend their pages.
+  buf = sbrk(MAXSZ + PGSIZE);
+  if(buf == SBRK_ERROR){
+    printf("pipebench: sbrk failed\n");
+    exit(1);
+  }
+  buf = (char*)PGROUNDUP((uint64)buf);
+  memset(buf, 'x', MAXSZ);
+
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    sz = sizes[i];
+    if(pipe(fds) < 0){
+      printf("pipebench: pipe failed\n");
+      exit(1);
+    }
+    if(pipesz && fcntl(fds[1], F_SETPIPE_SZ, pipesz) < 0){
+      printf("pipebench: cannot set pipe size %d\n", pipesz);
+      exit(1);
+    }
+    psz = fcntl(fds[0], F_GETPIPE_SZ, 0);
+    t0 = uptime();
+    pid = fork();
+    if(pid < 0){
+      printf("pipebench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      for(n = 0; n < total; n += sz){
+        if(write(fds[1], buf, sz) != sz){
+          printf("pipebench: write failed\n");
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+    close(fds[1]);
+    n = 0;
+    while((t1 = read(fds[0], buf, sz)) > 0)
+      n += t1;
+    close(fds[0]);
+    wait(0);
+    t1 = uptime();
+    if(n < total){
+      printf("pipebench: read %d bytes, expected %d\n", n, total);
+      exit(1);
+    }
+    if(t1 == t0)
+      t1 = t0 + 1;
+    // a tick is about 1/10th of a second.
+    printf("pipebench: %d-byte pipe, %d-byte writes: %d KB in %d ticks, %d KB/sec\n",
+           psz, sz, kb, t1 - t0, kb * 10 / (t1 - t0));
+  }
+  exit(0);
+}
@@ -0,0 +1,59 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+// Measure sequential file read throughput the way cat reads a
+// file, 512 bytes at a time. The file is much larger than the
+// buffer cache, so most of its blocks come from the disk.
+//   readbench [kbytes]
+
+char buf[BSIZE];
+
+int
+main(int argc, char *argv[])
+{
+  int kb = 400;
+  int fd, i, n, t0, t1;
+
+  if(argc > 1)
+    kb = atoi(argv[1]);
+
+  fd = open("readbench.tmp", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("readbench: cannot create file\n");
+    exit(1);
+  }
+  for(i = 0; i < kb; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("readbench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("readbench.tmp", O_RDONLY);
+  if(fd < 0){
+    printf("readbench: cannot open file\n");
+    exit(1);
+  }
+  t0 = uptime();
+  n = 0;
+  while((i = read(fd, buf, 512)) > 0)
+    n += i;
+  t1 = uptime();
+  close(fd);
+  unlink("readbench.tmp");
+
+  if(n != kb * BSIZE){
+    printf("readbench: read %d bytes, expected %d\n", n, kb * BSIZE);
+    exit(1);
+  }
+  if(t1 == t0)
+    t1 = t0 + 1;
+  // a tick is about 1/10th of a second.
+  printf("readbench: %d KB in %d ticks, %d KB/sec\n", kb, t1 - t0, kb * 10 / (t1 - t0));
+  exit(0);
+}
@@ -16,11 +16,12 @@
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  int fd, i, t0;
   char path[] = "stressfs0";
   char data[512];
 
   printf("stressfs starting\n");
+  t0 = uptime();
   memset(data, 'a', sizeof(data));
 
   for(i = 0; i < 4; i++)
@@ -45,5 +46,13 @@ main(int argc, char *argv[])
 
   wait(0);
 
+  if(path[8] == '0'){
+    // the first process waits for all the others.
+    int t = uptime() - t0;
+    if(t == 0)
+      t = 1;
+    printf("stressfs: %d writes in %d ticks, %d writes/sec\n", 5*20, t, 5*20*10/t);
+  }
+
   exit(0);
 }
@@ -45,14 +45,34 @@ strlen(const char *s)
   return n;
 }
 
+// memset, memmove and memcmp work a 64-bit word at a time
+// once the pointers are 8-byte aligned, as kernel/string.c's
+// do; see there.
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  if(n >= 16){
+    for(; (uint64)cdst % 8; n--)
+      *cdst++ = c;
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wdst = (uint64 *) cdst;
+    for(; n >= 64; n -= 64, wdst += 8){
+      wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+      wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
+    }
+    for(; n >= 8; n -= 8)
+      *wdst++ = w;
+    cdst = (char *) wdst;
   }
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -113,15 +133,53 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  const uint64 *ws;
+  uint64 *wd, a0, a1, a2, a3, a4, a5, a6, a7;
+  int words;
 
   dst = vdst;
   src = vsrc;
+  words = n >= 16 && ((uint64)src - (uint64)dst) % 8 == 0;
   if (src > dst) {
+    if(words){
+      for(; (uint64)dst % 8; n--)
+        *dst++ = *src++;
+      ws = (const uint64 *) src;
+      wd = (uint64 *) dst;
+      for(; n >= 64; n -= 64, ws += 8, wd += 8){
+        a0 = ws[0]; a1 = ws[1]; a2 = ws[2]; a3 = ws[3];
+        a4 = ws[4]; a5 = ws[5]; a6 = ws[6]; a7 = ws[7];
+        wd[0] = a0; wd[1] = a1; wd[2] = a2; wd[3] = a3;
+        wd[4] = a4; wd[5] = a5; wd[6] = a6; wd[7] = a7;
+      }
+      for(; n >= 8; n -= 8)
+        *wd++ = *ws++;
+      src = (const char *) ws;
+      dst = (char *) wd;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(words){
+      for(; (uint64)dst % 8; n--)
+        *--dst = *--src;
+      ws = (const uint64 *) src;
+      wd = (uint64 *) dst;
+      for(; n >= 64; n -= 64){
+        ws -= 8;
+        wd -= 8;
+        a0 = ws[0]; a1 = ws[1]; a2 = ws[2]; a3 = ws[3];
+        a4 = ws[4]; a5 = ws[5]; a6 = ws[6]; a7 = ws[7];
+        wd[0] = a0; wd[1] = a1; wd[2] = a2; wd[3] = a3;
+        wd[4] = a4; wd[5] = a5; wd[6] = a6; wd[7] = a7;
+      }
+      for(; n >= 8; n -= 8)
+        *--wd = *--ws;
+      src = (const char *) ws;
+      dst = (char *) wd;
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -132,6 +190,20 @@ int
 memcmp(const void *s1, const void *s2, uint n)
 {
   const char *p1 = s1, *p2 = s2;
+  const uint64 *w1, *w2;
+
+  if(n >= 16 && ((uint64)p1 - (uint64)p2) % 8 == 0){
+    for(; (uint64)p1 % 8; n--, p1++, p2++)
+      if(*p1 != *p2)
+        return *p1 - *p2;
+    w1 = (const uint64 *) p1;
+    w2 = (const uint64 *) p2;
+    for(; n >= 8 && *w1 == *w2; n -= 8)
+      w1++, w2++;
+    // the bytes from here on include any difference.
+    p1 = (const char *) w1;
+    p2 = (const char *) w2;
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
@@ -24,6 +24,11 @@ int getpid(void);
 char* sys_sbrk(int,int);
 int pause(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, int);
+int munmap(void*, uint);
+int fcntl(int, int, int);
+int splice(int, int, int);
+int tee(int, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -197,6 +197,37 @@ copyinstr2(char *s)
   }
 }
 
+// do path names that cross a page boundary, at every
+// alignment, reach the kernel intact?
+void
+copyinstr4(char *s)
+{
+  char *top, *b, name[16];
+  int off, fd;
+
+  top = sbrk(0);
+  if(sbrk(PGSIZE - (uint64)top % PGSIZE + 2*PGSIZE) == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  top += PGSIZE - (uint64)top % PGSIZE + PGSIZE;
+  strcpy(name, "cistr4-abcdefg");
+  for(off = 1; off < 16; off++){
+    b = top - off;
+    strcpy(b, name);
+    if((fd = open(b, O_CREATE | O_WRONLY)) < 0){
+      printf("%s: open failed at offset %d\n", s, off);
+      exit(1);
+    }
+    close(fd);
+    if(unlink(name) != 0){
+      printf("%s: wrong name created at offset %d\n", s, off);
+      exit(1);
+    }
+    name[7]++;
+  }
+}
+
 // what if a string argument crosses over the end of last user page?
 void
 copyinstr3(char *s)
@@ -578,6 +609,10 @@ writetest(char *s)
   }
 }
 
+// big enough to need the doubly-indirect block,
+// small enough to fit on the disk.
+#define BIGBLOCKS (NDIRECT + NINDIRECT + 40)
+
 void
 writebig(char *s)
 {
@@ -589,7 +624,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -609,7 +644,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n != MAXFILE){
+      if(n != BIGBLOCKS){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -733,6 +768,514 @@ exectest(char *s)
 
 }
 
+// grow the heap by whole, aligned superpages, eagerly and
+// lazily, and check that fork and shrinking the heap into the
+// middle of one keep the right contents.
+void
+superpg(char *s)
+{
+  char *base, *p, *end;
+  uint64 top;
+  int pid, xstatus;
+
+  top = (uint64)sbrk(0);
+  if(sbrk(SUPERPGROUNDUP(top) - top) == SBRK_ERROR ||
+     (base = sbrk(2*SUPERPGSIZE)) == SBRK_ERROR ||
+     sbrklazy(2*SUPERPGSIZE) == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  end = base + 4*SUPERPGSIZE;
+  for(p = base; p < end; p += PGSIZE)
+    *(uint64*)p = (uint64)p;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = base; p < end; p += PGSIZE){
+      if(*(uint64*)p != (uint64)p)
+        exit(1);
+      *(uint64*)p = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+
+  // shrink into the middle of the second superpage.
+  if(sbrk(-(3*SUPERPGSIZE - SUPERPGSIZE/2)) == SBRK_ERROR){
+    printf("%s: shrink failed\n", s);
+    exit(1);
+  }
+  end = base + SUPERPGSIZE + SUPERPGSIZE/2;
+  for(p = base; p < end; p += PGSIZE){
+    if(*(uint64*)p != (uint64)p){
+      printf("%s: wrong data at %p\n", s, p);
+      exit(1);
+    }
+  }
+}
+
+// several processes at once grow their heaps by odd amounts,
+// some of them megapages and some pages, and shrink them again,
+// so the kernel splits and merges physical blocks of all sizes.
+void
+buddymix(char *s)
+{
+  int i, j, n, pid, xstatus;
+  char *base, *p;
+
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < 20; j++){
+        n = (j % 3) * SUPERPGSIZE + (i * 7 + j * 13) % 61 * PGSIZE + 1;
+        if((base = sbrk(n)) == SBRK_ERROR)
+          exit(1);
+        for(p = base; p < base + n; p += PGSIZE)
+          *p = i + j;
+        for(p = base; p < base + n; p += PGSIZE)
+          if(*p != (char)(i + j))
+            exit(2);
+        if(sbrk(-n) == SBRK_ERROR)
+          exit(3);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed with %d\n", s, xstatus);
+      exit(1);
+    }
+  }
+}
+
+// copy program src to dst, truncating dst, and run it with
+// argument "nonexistent" and its output closed. returns its
+// exit status.
+int
+runcopy(char *s, char *src, char *dst)
+{
+  char *argv[] = { dst, "nonexistent", 0 };
+  char b[512];
+  int fd0, fd1, n, pid, xstatus;
+
+  fd0 = open(src, O_RDONLY);
+  fd1 = open(dst, O_CREATE|O_TRUNC|O_WRONLY);
+  if(fd0 < 0 || fd1 < 0){
+    printf("%s: open %s or %s failed\n", s, src, dst);
+    exit(1);
+  }
+  while((n = read(fd0, b, sizeof(b))) > 0){
+    if(write(fd1, b, n) != n){
+      printf("%s: write %s failed\n", s, dst);
+      exit(1);
+    }
+  }
+  close(fd0);
+  close(fd1);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    close(2);
+    exec(dst, argv);
+    exit(7);
+  }
+  wait(&xstatus);
+  return xstatus;
+}
+
+// exec shares file pages through the kernel's page cache;
+// check that a program file rewritten in place, or unlinked
+// and re-created, runs the new program and not cached pages
+// of the old one. echo exits 0; cat of a missing file exits 1.
+void
+exectext(char *s)
+{
+  unlink("textx");
+  if(runcopy(s, "echo", "textx") != 0){
+    printf("%s: echo copy failed\n", s);
+    exit(1);
+  }
+  if(runcopy(s, "cat", "textx") != 1){
+    printf("%s: rewritten program ran stale text\n", s);
+    exit(1);
+  }
+  unlink("textx");
+  if(runcopy(s, "echo", "textx") != 0){
+    printf("%s: re-created program ran stale text\n", s);
+    exit(1);
+  }
+  unlink("textx");
+}
+
+// a program file can't be written or truncated while a process
+// runs it, since exec reads its pages in as the program touches
+// them, nor written through a descriptor opened before the exec;
+// once the program exits, it can. runs a copy of cat between two
+// pipes.
+void
+textbusy(char *s)
+{
+  char *argv[] = { "txtbusy", 0 };
+  char b[512];
+  int fd, fdw, n, pid, xstatus, in[2], out[2];
+
+  unlink("txtbusy");
+  fd = open("cat", O_RDONLY);
+  fdw = open("txtbusy", O_CREATE|O_WRONLY);
+  if(fd < 0 || fdw < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  while((n = read(fd, b, sizeof(b))) > 0){
+    if(write(fdw, b, n) != n){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  if(pipe(in) < 0 || pipe(out) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(0);
+    dup(in[0]);
+    close(1);
+    dup(out[1]);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(fdw);
+    exec("txtbusy", argv);
+    exit(7);
+  }
+  close(in[0]);
+  close(out[1]);
+
+  // the copy of cat is running once it echoes a byte.
+  if(write(in[1], "x", 1) != 1 || read(out[0], b, 1) != 1 || b[0] != 'x'){
+    printf("%s: program didn't run\n", s);
+    exit(1);
+  }
+  if(write(fdw, b, 1) >= 0){
+    printf("%s: wrote a running program\n", s);
+    exit(1);
+  }
+  if((fd = open("txtbusy", O_RDWR)) >= 0 ||
+     (fd = open("txtbusy", O_WRONLY|O_TRUNC)) >= 0){
+    printf("%s: opened a running program for writing\n", s);
+    exit(1);
+  }
+  if((fd = open("txtbusy", O_RDONLY)) < 0){
+    printf("%s: can't open a running program for reading\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(write(in[1], "y", 1) != 1 || read(out[0], b, 1) != 1 || b[0] != 'y'){
+    printf("%s: program stopped working\n", s);
+    exit(1);
+  }
+  close(in[1]);
+  wait(&xstatus);
+  close(out[0]);
+  if(xstatus != 0){
+    printf("%s: program failed\n", s);
+    exit(1);
+  }
+
+  if(write(fdw, b, 1) != 1){
+    printf("%s: can't write a program that has exited\n", s);
+    exit(1);
+  }
+  close(fdw);
+  if((fd = open("txtbusy", O_WRONLY|O_TRUNC)) < 0){
+    printf("%s: can't truncate a program that has exited\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("txtbusy");
+}
+
+// splice a file into a pipe, tee it to a second pipe, and
+// splice both pipes into files.
+void
+splicetest(char *s)
+{
+  enum { N = 3000 };
+  int fd, fd1, a[2], b[2], i, n;
+
+  unlink("splice0");
+  unlink("splice1");
+  fd = open("splice0", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = i % 251;
+  if(write(fd, buf, N) != N){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(a) != 0 || pipe(b) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  fd = open("splice0", O_RDONLY);
+  if(splice(fd, a[0], N) != -1 || splice(fd, a[1], 0) != 0){
+    printf("%s: bad splice succeeded\n", s);
+    exit(1);
+  }
+  if((n = splice(fd, a[1], N + 100)) != N){
+    printf("%s: splice from file moved %d bytes\n", s, n);
+    exit(1);
+  }
+  if(splice(fd, a[1], 10) != 0){
+    printf("%s: splice past end of file\n", s);
+    exit(1);
+  }
+  close(fd);
+  close(a[1]);
+
+  // tee copies without consuming.
+  for(i = 0; i < N; i += n){
+    if((n = tee(a[0], b[1], N - i)) <= 0){
+      printf("%s: tee failed\n", s);
+      exit(1);
+    }
+    if(read(b[0], buf, n) != n){
+      printf("%s: read of tee failed\n", s);
+      exit(1);
+    }
+    for(int j = 0; j < n; j++){
+      if(buf[j] != (char)((i + j) % 251)){
+        printf("%s: wrong data from tee\n", s);
+        exit(1);
+      }
+    }
+    // consume what tee copied.
+    if(read(a[0], buf, n) != n){
+      printf("%s: pipe read failed\n", s);
+      exit(1);
+    }
+  }
+  close(a[0]);
+  close(b[0]);
+  close(b[1]);
+
+  // file to pipe to file, through a child.
+  if(pipe(a) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fork() == 0){
+    close(a[0]);
+    fd = open("splice0", O_RDONLY);
+    while((n = splice(fd, a[1], 1000)) > 0)
+      ;
+    exit(n == 0 ? 0 : 1);
+  }
+  close(a[1]);
+  fd1 = open("splice1", O_CREATE|O_RDWR);
+  while((n = splice(a[0], fd1, 700)) > 0)
+    ;
+  close(a[0]);
+  wait(&i);
+  if(n != 0 || i != 0){
+    printf("%s: splice through a pipe failed\n", s);
+    exit(1);
+  }
+  close(fd1);
+  fd1 = open("splice1", O_RDONLY);
+  if(read(fd1, buf, N + 1) != N){
+    printf("%s: spliced file has the wrong size\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(buf[i] != (char)(i % 251)){
+      printf("%s: wrong data in spliced file\n", s);
+      exit(1);
+    }
+  }
+  close(fd1);
+  unlink("splice0");
+  unlink("splice1");
+}
+
+// a tee() that waits for room in its output pipe must not keep
+// others from reading its input pipe.
+void
+teewait(char *s)
+{
+  int a[2], b[2], sz, n, tot, xstatus;
+
+  if(pipe(a) != 0 || pipe(b) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  sz = fcntl(b[1], F_GETPIPE_SZ, 0);
+  // buf+1, so that write() doesn't lend its pages instead.
+  if(sz <= 0 || sz > sizeof(buf) - 1 || write(b[1], buf + 1, sz) != sz){
+    printf("%s: couldn't fill pipe\n", s);
+    exit(1);
+  }
+  if(write(a[1], "0123456789", 10) != 10){
+    printf("%s: pipe write failed\n", s);
+    exit(1);
+  }
+  close(a[1]);
+
+  if(fork() == 0){
+    // b is full, so this waits until the parent drains it.
+    tee(a[0], b[1], 10);
+    exit(0);
+  }
+  close(b[1]);
+  pause(2);
+  if(read(a[0], buf, 10) != 10){
+    printf("%s: read of tee's input failed\n", s);
+    exit(1);
+  }
+  tot = 0;
+  while((n = read(b[0], buf, sizeof(buf))) > 0)
+    tot += n;
+  wait(&xstatus);
+  if(tot != sz && tot != sz + 10){
+    printf("%s: read %d bytes of tee's output\n", s, tot);
+    exit(1);
+  }
+  close(a[0]);
+  close(b[0]);
+}
+
+// a page-aligned write of whole pages lends them to the pipe;
+// the writer's later changes must not reach the reader.
+void
+pipeloan(char *s)
+{
+  int fds[2], i;
+  char *p, *b;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  p = sbrk(3*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  p = (char*)PGROUNDUP((uint64)p);
+  memset(p, 'a', 2*PGSIZE);
+  if(write(fds[1], p, 2*PGSIZE) != 2*PGSIZE){
+    printf("%s: pipe write failed\n", s);
+    exit(1);
+  }
+  memset(p, 'b', 2*PGSIZE);
+  b = p + PGSIZE;
+  for(i = 0; i < 2; i++){
+    if(read(fds[0], b, PGSIZE) != PGSIZE){
+      printf("%s: pipe read failed\n", s);
+      exit(1);
+    }
+    for(int j = 0; j < PGSIZE; j++){
+      if(b[j] != 'a'){
+        printf("%s: pipe data changed after write\n", s);
+        exit(1);
+      }
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// grow and shrink a pipe's buffer with fcntl().
+void
+pipesz(char *s)
+{
+  int fds[2], i, n;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[0], F_GETPIPE_SZ, 0) != PGSIZE){
+    printf("%s: default pipe size isn't a page\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, 3*PGSIZE) != 4*PGSIZE){
+    printf("%s: pipe size not rounded to a power of two\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, 1<<30) != -1){
+    printf("%s: huge pipe size succeeded\n", s);
+    exit(1);
+  }
+  // fill the pipe without a reader; the write must not block.
+  for(i = 0; i < 4*PGSIZE; i += n){
+    for(int j = 0; j < 512; j++)
+      buf[j] = i + j;
+    if((n = write(fds[1], buf, 512)) != 512){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, PGSIZE) != -1){
+    printf("%s: shrank a pipe below its contents\n", s);
+    exit(1);
+  }
+  // read half, then shrink and check that the rest survived.
+  for(i = 0; i < 2*PGSIZE; i += n)
+    if((n = read(fds[0], buf, 512)) != 512)
+      break;
+  if(fcntl(fds[0], F_SETPIPE_SZ, 2*PGSIZE) != 2*PGSIZE){
+    printf("%s: shrink failed\n", s);
+    exit(1);
+  }
+  for(; i < 4*PGSIZE; i += n){
+    if((n = read(fds[0], buf, 512)) != 512){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(int j = 0; j < 512; j++){
+      if(buf[j] != (char)(i + j)){
+        printf("%s: wrong data after resize\n", s);
+        exit(1);
+      }
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
 // simple fork and pipe read/write
 
 void
@@ -789,6 +1332,57 @@ pipe1(char *s)
 }
 
 
+// wait() returns each child's pid once, whatever order they
+// exit in, and kill() finds only pids that are still around.
+void
+waitkill(char *s)
+{
+  int pids[20], i, j, pid, xstatus, seen;
+
+  for(i = 0; i < 20; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      if(i % 2 == 0)
+        pause(20 - i);
+      exit(i);
+    }
+  }
+  // the odd children are zombies by now, or soon will be; the
+  // even ones are still around, so kill() finds them.
+  for(i = 0; i < 20; i += 2)
+    if(kill(pids[i]) != 0){
+      printf("%s: kill(%d) failed\n", s, pids[i]);
+      exit(1);
+    }
+  seen = 0;
+  for(i = 0; i < 20; i++){
+    pid = wait(&xstatus);
+    for(j = 0; j < 20 && pids[j] != pid; j++)
+      ;
+    if(j == 20 || (seen & (1 << j))){
+      printf("%s: wait returned %d\n", s, pid);
+      exit(1);
+    }
+    seen |= 1 << j;
+    if(j % 2 == 1 && xstatus != j){
+      printf("%s: child %d exited with %d\n", s, j, xstatus);
+      exit(1);
+    }
+  }
+  if(wait(0) != -1){
+    printf("%s: wait with no children succeeded\n", s);
+    exit(1);
+  }
+  if(kill(pids[0]) != -1 || kill(0) != -1 || kill(-1) != -1){
+    printf("%s: kill of a missing pid succeeded\n", s);
+    exit(1);
+  }
+}
+
 // test if child is killed (status = -1)
 void
 killstatus(char *s)
@@ -1148,6 +1742,73 @@ sharedfd(char *s)
   }
 }
 
+// eight processes each hold 14 files of their own open at
+// once: more open files and in-memory inodes than fixed-size
+// kernel tables would have room for.
+void
+manyfiles(char *s)
+{
+  char name[8];
+  int i, j, fd, pid, xstatus;
+  int p[2], q[2];
+
+  if(pipe(p) < 0 || pipe(q) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(p[1]);
+      close(q[0]);
+      name[0] = 'm';
+      name[1] = 'f';
+      name[2] = 'a' + i;
+      name[4] = 0;
+      xstatus = 0;
+      for(j = 0; j < 14 && xstatus == 0; j++){
+        name[3] = 'a' + j;
+        if((fd = open(name, O_CREATE | O_RDWR)) < 0)
+          xstatus = 1;
+        else if(write(fd, name, 4) != 4)
+          xstatus = 2;
+      }
+      // wait until every child has its files open.
+      write(q[1], "x", 1);
+      read(p[0], name, 1);
+      exit(xstatus);
+    }
+  }
+  close(p[0]);
+  close(q[1]);
+  for(i = 0; i < 8; i++)
+    if(read(q[0], name, 1) != 1)
+      break;
+  close(q[0]);
+  close(p[1]);
+  for(i = 0; i < 8; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed with %d\n", s, xstatus);
+      exit(1);
+    }
+  }
+  name[0] = 'm';
+  name[1] = 'f';
+  name[4] = 0;
+  for(i = 0; i < 8; i++){
+    name[2] = 'a' + i;
+    for(j = 0; j < 14; j++){
+      name[3] = 'a' + j;
+      unlink(name);
+    }
+  }
+}
+
 // four processes write different files at the same
 // time, to test block allocation.
 void
@@ -1924,9 +2585,12 @@ dirfile(char *s)
 void
 iref(char *s)
 {
+  // the old NINODE+1: more directories than the fixed inode
+  // table held, to churn the inode cache as it grows and shrinks.
+  enum { N = 51 };
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -1948,7 +2612,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -1996,6 +2660,76 @@ forktest(char *s)
   }
 }
 
+// fork a process that uses more than half of free memory,
+// which only works if fork shares pages copy-on-write.
+// check that parent and child see their own writes, and
+// that copyout() into a shared page doesn't leak across.
+void
+cowfork(char *s)
+{
+  int n, i, fds[2], xstatus;
+  char *p, *a;
+
+  p = sbrk(0);
+  for(n = 0; sbrk(PGSIZE) != SBRK_ERROR; n++)
+    ;
+  sbrk(-(n * PGSIZE));
+  n = (n / 3) * 2;
+  if((a = sbrk(n * PGSIZE)) == SBRK_ERROR || a != p){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++)
+    *(int*)(a + i*PGSIZE) = i;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < n; i += 7)
+      *(int*)(a + i*PGSIZE) = -i;
+    for(i = 0; i < n; i++){
+      if(*(int*)(a + i*PGSIZE) != (i % 7 == 0 ? -i : i)){
+        printf("%s: child sees wrong value\n", s);
+        exit(1);
+      }
+    }
+    // read() into a page still shared with the parent.
+    close(fds[1]);
+    if(read(fds[0], a + PGSIZE + 4, 4) != 4){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  close(fds[0]);
+  if(write(fds[1], "cow!", 4) != 4){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(i = 0; i < n; i++){
+    if(*(int*)(a + i*PGSIZE) != i){
+      printf("%s: parent sees child's write\n", s);
+      exit(1);
+    }
+  }
+  if(memcmp(a + PGSIZE + 4, "cow!", 4) == 0){
+    printf("%s: parent sees child's read()\n", s);
+    exit(1);
+  }
+  sbrk(-(n * PGSIZE));
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2281,6 +3015,55 @@ validatetest(char *s)
   }
 }
 
+// check memset, memmove and memcmp, which work a word at a
+// time, against byte-at-a-time copies, for every alignment
+// and for overlapping moves in both directions.
+void
+memops(char *s)
+{
+  static char a[300], b[300];
+  int i, n, d, o;
+
+  for(n = 0; n < 200; n += 13){
+    for(d = 0; d < 8; d++){
+      for(o = -20; o <= 20; o += 5){
+        for(i = 0; i < sizeof(a); i++)
+          a[i] = b[i] = i * 7;
+        memmove(a + 40 + d + o, a + 40 + d, n);
+        if(o > 0){
+          for(i = n - 1; i >= 0; i--)
+            b[40 + d + o + i] = b[40 + d + i];
+        } else {
+          for(i = 0; i < n; i++)
+            b[40 + d + o + i] = b[40 + d + i];
+        }
+        if(memcmp(a, b, sizeof(a)) != 0){
+          printf("%s: memmove %d bytes by %d wrong\n", s, n, o);
+          exit(1);
+        }
+        for(i = 0; i < sizeof(a); i++)
+          if(a[i] != b[i]){
+            printf("%s: memcmp missed a difference\n", s);
+            exit(1);
+          }
+      }
+      memset(a + d, d + 1, n);
+      for(i = 0; i < sizeof(a); i++)
+        if(a[i] != (i >= d && i < d + n ? d + 1 : b[i])){
+          printf("%s: memset %d bytes at %d wrong\n", s, n, d);
+          exit(1);
+        }
+      if(n > 0){
+        b[d + n - 1] = a[d + n - 1] + 1;
+        if(memcmp(a + d, b + d, n) == 0){
+          printf("%s: memcmp missed a difference\n", s);
+          exit(1);
+        }
+      }
+    }
+  }
+}
+
 // does uninitialized data start out zero?
 char uninit[10000];
 void
@@ -2296,6 +3079,32 @@ bsstest(char *s)
   }
 }
 
+// do new heap pages start out zero, when they come from
+// pages that were freed dirty and zeroed while the CPUs
+// were idle?
+void
+zeropages(char *s)
+{
+  char *p, *q;
+  int i, n = 64*4096;
+
+  for(i = 0; i < 4; i++){
+    if((p = sbrk(n)) == SBRK_ERROR){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(q = p; q < p + n; q++)
+      if(*q != 0){
+        printf("%s: page not zero at %p\n", s, q);
+        exit(1);
+      }
+    memset(p, 0xff, n);
+    sbrk(-n);
+    // let the idle CPUs zero the freed pages.
+    pause(2);
+  }
+}
+
 // does exec return an error if the arguments
 // are larger than a page? or does it write
 // below the stack and wreck the instructions/data?
@@ -2614,6 +3423,47 @@ lazy_alloc(char *s)
   exit(0);
 }
 
+int countfree();
+
+// Touch a page every 256 KB of a lazily allocated heap, which
+// must cost about a page per touch, not a megapage; then touch
+// every page of a 2 MB stretch, which may move it to a
+// megapage, and check that the values survive.
+void
+lazysparse(char *s)
+{
+  enum { SZ = 32*1024*1024, STEP = 256*1024 };
+  char *top, *base, *p;
+  int free0, free1;
+
+  free0 = countfree();
+  top = sbrk(0);
+  if(sbrklazy(SUPERPGROUNDUP((uint64)top) - (uint64)top) == SBRK_ERROR ||
+     (base = sbrklazy(SZ)) == SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  for(p = base; p < base + SZ; p += STEP)
+    *(char**)p = p;
+  free1 = countfree();
+  if(free0 - free1 > SZ/STEP + 64){
+    printf("%s: %d touches used %d pages\n", s, SZ/STEP, free0 - free1);
+    exit(1);
+  }
+
+  for(p = base; p < base + SUPERPGSIZE; p += PGSIZE)
+    *(char**)p = p;
+  for(p = base; p < base + SZ; p += PGSIZE){
+    if(p >= base + SUPERPGSIZE && (p - base) % STEP != 0)
+      continue;
+    if(*(char**)p != p){
+      printf("%s: wrong value at %p\n", s, p);
+      exit(1);
+    }
+  }
+  sbrk(top - sbrk(0));
+}
+
 // Touch a page every 64 pages in region, which with lazy allocation
 // causes one page to be allocated. Check that freeing the region
 // frees the allocated pages.
@@ -2698,6 +3548,244 @@ lazy_copy(char *s)
   exit(0);
 }
 
+// check that file name holds n bytes, all c's.
+void
+mmapcheck(char *s, char *name, int n, char c)
+{
+  char b[PGSIZE/4];
+  int fd, i, m, tot = 0;
+
+  if((fd = open(name, O_RDONLY)) < 0){
+    printf("%s: open %s failed\n", s, name);
+    exit(1);
+  }
+  while((m = read(fd, b, sizeof(b))) > 0){
+    for(i = 0; i < m; i++){
+      if(b[i] != c){
+        printf("%s: byte %d of %s is %d not %d\n", s, tot + i, name, b[i], c);
+        exit(1);
+      }
+    }
+    tot += m;
+  }
+  close(fd);
+  if(tot != n){
+    printf("%s: %s has %d bytes not %d\n", s, name, tot, n);
+    exit(1);
+  }
+}
+
+// mmap() a file private and shared, through fork, munmap()
+// of part of a region, and exit().
+void
+mmaptest(char *s)
+{
+  enum { N = 2*PGSIZE + 100 };
+  char *p, *q;
+  int fd, i, pid, xstatus;
+
+  unlink("mmapf");
+  if((fd = open("mmapf", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', N);
+  if(write(fd, buf, N) != N){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  // private: reads see the file, zeros past its end; writes
+  // don't reach it.
+  p = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3*PGSIZE; i++){
+    if(p[i] != (i < N ? 'a' : 0)){
+      printf("%s: private mapping byte %d is %d\n", s, i, p[i]);
+      exit(1);
+    }
+  }
+  memset(p, 'b', 3*PGSIZE);
+  if(munmap(p, 3*PGSIZE) < 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+  mmapcheck(s, "mmapf", N, 'a');
+
+  // shared: a child's writes reach the parent's mapping and,
+  // after munmap() of the middle page and exit, the file.
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  p[0] = 'x';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[0] != 'x')
+      exit(1);
+    memset(p, 'c', N);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[N-1] != 'c'){
+    printf("%s: shared mapping not shared with child\n", s);
+    exit(1);
+  }
+  if(munmap(p + PGSIZE, PGSIZE) < 0){
+    printf("%s: munmap of middle page failed\n", s);
+    exit(1);
+  }
+  q = p + 2*PGSIZE;
+  if(p[0] != 'c' || q[0] != 'c'){
+    printf("%s: munmap lost the rest of the region\n", s);
+    exit(1);
+  }
+  mmapcheck(s, "mmapf", N, 'c');
+  if(munmap(p, PGSIZE) < 0 || munmap(q, PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  if(munmap(p, PGSIZE) == 0){
+    printf("%s: munmap of unmapped page succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // a read-only descriptor can't be mapped shared and writable.
+  fd = open("mmapf", O_RDONLY);
+  if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED){
+    printf("%s: mmap of read-only file for writing succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapf");
+}
+
+// two processes that mmap() the same file MAP_SHARED on their
+// own see each other's stores at once, including in the last,
+// partial page, and read() and write() agree with the mappings.
+void
+mmapshared(char *s)
+{
+  enum { N = PGSIZE + 100 };
+  char *p, c;
+  int fd, pid, xstatus, toc[2], top[2];
+
+  unlink("mmapsf");
+  if((fd = open("mmapsf", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', N);
+  if(write(fd, buf, N) != N){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(toc) < 0 || pipe(top) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if((fd = open("mmapsf", O_RDWR)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+
+  if(pid == 0){
+    // wait for the parent's stores, then answer with our own.
+    if(read(toc[0], &c, 1) != 1)
+      exit(1);
+    if(p[0] != 'b' || p[N-1] != 'b'){
+      printf("%s: child doesn't see parent's stores\n", s);
+      exit(1);
+    }
+    p[1] = 'c';
+    p[N-2] = 'c';
+    write(top[1], "x", 1);
+
+    // wait for the parent's write(), which must reach the mapping.
+    if(read(toc[0], &c, 1) != 1)
+      exit(1);
+    if(p[PGSIZE] != 'd'){
+      printf("%s: child doesn't see write()\n", s);
+      exit(1);
+    }
+    p[2] = 'e';
+    exit(0);
+  }
+
+  p[0] = 'b';
+  p[N-1] = 'b';
+  write(toc[1], "x", 1);
+  if(read(top[0], &c, 1) != 1 || p[1] != 'c' || p[N-2] != 'c'){
+    printf("%s: parent doesn't see child's stores\n", s);
+    exit(1);
+  }
+  // read() sees the stores before they are written back, and
+  // write() reaches the mappings.
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'b' || buf[1] != 'c'){
+    printf("%s: read() doesn't see stores\n", s);
+    exit(1);
+  }
+  if(write(fd, "d", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(p[PGSIZE] != 'd'){
+    printf("%s: parent doesn't see write()\n", s);
+    exit(1);
+  }
+  write(toc[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(p[2] != 'e'){
+    printf("%s: parent doesn't see exited child's stores\n", s);
+    exit(1);
+  }
+  if(munmap(p, N) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  close(toc[0]);
+  close(toc[1]);
+  close(top[0]);
+  close(top[1]);
+
+  // after the last munmap(), the file holds every store.
+  if((fd = open("mmapsf", O_RDONLY)) < 0 || read(fd, buf, N+1) != N){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(buf[0] != 'b' || buf[1] != 'c' || buf[2] != 'e' || buf[3] != 'a' ||
+     buf[PGSIZE] != 'd' || buf[N-2] != 'c' || buf[N-1] != 'b'){
+    printf("%s: file doesn't hold the stores\n", s);
+    exit(1);
+  }
+  unlink("mmapsf");
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2707,6 +3795,7 @@ struct test {
   {copyinstr1, "copyinstr1"},
   {copyinstr2, "copyinstr2"},
   {copyinstr3, "copyinstr3"},
+  {copyinstr4, "copyinstr4"},
   {rwsbrk, "rwsbrk" },
   {truncate1, "truncate1"},
   {truncate2, "truncate2"},
@@ -2720,8 +3809,17 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {exectext, "exectext"},
+  {textbusy, "textbusy"},
+  {superpg, "superpg"},
+  {buddymix, "buddymix"},
   {pipe1, "pipe1"},
+  {pipeloan, "pipeloan"},
+  {pipesz, "pipesz"},
+  {splicetest, "splicetest"},
+  {teewait, "teewait"},
   {killstatus, "killstatus"},
+  {waitkill, "waitkill"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
@@ -2732,6 +3830,7 @@ struct test {
   {mem, "mem"},
   {sharedfd, "sharedfd"},
   {fourfiles, "fourfiles"},
+  {manyfiles, "manyfiles"},
   {createdelete, "createdelete"},
   {unlinkread, "unlinkread"},
   {linktest, "linktest"},
@@ -2745,6 +3844,7 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
@@ -2753,6 +3853,8 @@ struct test {
   {sbrkarg, "sbrkarg"},
   {validatetest, "validatetest"},
   {bsstest, "bsstest"},
+  {memops, "memops"},
+  {zeropages, "zeropages"},
   {bigargtest, "bigargtest"},
   {argptest, "argptest"},
   {stacktest, "stacktest"},
@@ -2763,8 +3865,11 @@ struct test {
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
   {lazy_alloc, "lazy_alloc"},
+  {lazysparse, "lazysparse"},
   {lazy_unmap, "lazy_unmap"},
   {lazy_copy, "lazy_copy"},
+  {mmaptest, "mmaptest"},
+  {mmapshared, "mmapshared"},
   { 0, 0},
 };
 
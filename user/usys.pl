@@ -42,3 +42,8 @@ entry("getpid");
 entry("sbrk");
 entry("pause");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("fcntl");
+entry("splice");
+entry("tee");